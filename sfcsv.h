@@ -28,18 +28,171 @@ THE SOFTWARE.
 #define SFCSV_H
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <iterator>
+#include <istream>
+#include <ostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <random>
 #include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SFCSV_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace sfcsv {
 
+/**
+ * @brief Position that is not known, e.g. the record when parsing a single line
+ */
+const std::size_t npos = static_cast<std::size_t>(-1);
+
 /**
  * @brief Exception class for csv errors
  */
 struct csv_error : public std::runtime_error {
     csv_error(const char *msg) : std::runtime_error(msg) {}
+
+    csv_error(const char *msg, const std::size_t record, const std::size_t field,
+              const std::size_t offset, std::string excerpt)
+        : std::runtime_error(msg), _record(record), _field(field), _offset(offset),
+          _excerpt(std::move(excerpt)) {}
+
+    /**
+     * @return Zero-based record number (the header is record 0)
+     */
+    std::size_t record() const {
+        return _record;
+    }
+
+    /**
+     * @return Zero-based index of the field with the error
+     */
+    std::size_t field() const {
+        return _field;
+    }
+
+    /**
+     * @return Offset of the error from the start of the line, or of the stream for reader
+     */
+    std::size_t offset() const {
+        return _offset;
+    }
+
+    /**
+     * @return Text around the error, non-ASCII characters replaced with '?'
+     */
+    const std::string &excerpt() const {
+        return _excerpt;
+    }
+
+private:
+    std::size_t _record = npos;
+    std::size_t _field = npos;
+    std::size_t _offset = npos;
+    std::string _excerpt;
+};
+
+/**
+ * @brief Thrown when work is stopped through a cancellation
+ */
+struct cancelled_error : public std::runtime_error {
+    cancelled_error() : std::runtime_error("Cancelled") {}
+};
+
+/**
+ * @brief Cooperative cancellation with an optional deadline
+ *
+ * Functions that take a cancellation check it about once per block of
+ * input and throw cancelled_error once it has been cancelled or its
+ * deadline has passed. cancel() can be called from any thread.
+ */
+class cancellation {
+public:
+    using clock = std::chrono::steady_clock;
+
+    cancellation() = default;
+
+    /**
+     * @param deadline Time after which the work is cancelled
+     */
+    explicit cancellation(const clock::time_point deadline)
+        : _deadline(deadline), _has_deadline(true) {}
+
+    /**
+     * @param timeout Time from now after which the work is cancelled
+     */
+    template <class Rep, class Period>
+    explicit cancellation(const std::chrono::duration<Rep, Period> timeout)
+        : cancellation(clock::now() + std::chrono::duration_cast<clock::duration>(timeout)) {}
+
+    cancellation(const cancellation &) = delete;
+    cancellation& operator=(const cancellation &) = delete;
+
+    void cancel() {
+        _cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return True if cancel() was called or the deadline has passed
+     */
+    bool cancelled() const {
+        return _cancelled.load(std::memory_order_relaxed)
+               || (_has_deadline && clock::now() >= _deadline);
+    }
+
+    /**
+     * @throws cancelled_error If cancelled()
+     */
+    void check() const {
+        if(cancelled()) {
+            throw cancelled_error();
+        }
+    }
+
+private:
+    std::atomic<bool> _cancelled{false};
+    clock::time_point _deadline{};
+    bool _has_deadline = false;
 };
 
+namespace detail {
+
+// Amount of input between checks of a cancellation
+const std::size_t cancellation_block = 1 << 16;
+
+} // namespace detail
+
 /**
  * @brief Parser mode
  */
@@ -48,8 +201,30 @@ enum class mode {
     loose
 };
 
+/**
+ * @brief Field count checking mode for reader
+ */
+enum class column_check {
+    none,
+    report,
+    enforce
+};
+
+/**
+ * @brief Record whose field count differs from the header's
+ */
+struct ragged_record {
+    std::size_t record;
+    std::size_t offset;
+    std::size_t fields;
+};
+
 /**
  * @brief Default policy for strings
+ *
+ * reserve(), assign() and clear_keep_capacity() only take part in overload
+ * resolution when StringT has the matching member, so string types without
+ * them fall back to appending one character at a time.
  */
 struct default_policy {
     template <class StringT, class CharT = typename StringT::value_type>
@@ -66,13 +241,493 @@ struct default_policy {
     static bool empty(const StringT &str) {
         return str.empty();
     }
+
+    template <class StringT>
+    static auto reserve(StringT &str, const std::size_t count)
+        -> decltype(str.reserve(str.size() + count), void()) {
+        str.reserve(str.size() + count);
+    }
+
+    template <class StringT, class InIter>
+    static auto assign(StringT &str, InIter first, InIter last)
+        -> decltype(str.assign(first, last), void()) {
+        str.assign(first, last);
+    }
+
+    template <class StringT>
+    static auto clear_keep_capacity(StringT &str) -> decltype(str.clear(), void()) {
+        str.clear();
+    }
+};
+
+namespace detail {
+
+// Optional StringPolicy operations, detected with SFINAE
+
+template <class Policy, class StringT, class = void>
+struct has_reserve : std::false_type {};
+
+template <class Policy, class StringT>
+struct has_reserve<Policy, StringT, decltype(Policy::reserve(std::declval<StringT &>(),
+                                                              std::size_t()), void())>
+    : std::true_type {};
+
+template <class Policy, class StringT, class InIter, class = void>
+struct has_assign : std::false_type {};
+
+template <class Policy, class StringT, class InIter>
+struct has_assign<Policy, StringT, InIter, decltype(Policy::assign(std::declval<StringT &>(),
+                                                                   std::declval<InIter>(),
+                                                                   std::declval<InIter>()), void())>
+    : std::true_type {};
+
+template <class Policy, class StringT, class = void>
+struct has_clear_keep_capacity : std::false_type {};
+
+template <class Policy, class StringT>
+struct has_clear_keep_capacity<Policy, StringT, decltype(Policy::clear_keep_capacity(
+                                                             std::declval<StringT &>()), void())>
+    : std::true_type {};
+
+template <class Policy, class StringT>
+void policy_reserve(StringT &str, const std::size_t count, std::true_type) {
+    Policy::reserve(str, count);
+}
+
+template <class Policy, class StringT>
+void policy_reserve(StringT &, const std::size_t, std::false_type) {
+}
+
+template <class Policy, class StringT, class InIter>
+void policy_append(StringT &str, InIter first, InIter last, std::false_type) {
+    policy_reserve<Policy>(str, static_cast<std::size_t>(std::distance(first, last)),
+                           has_reserve<Policy, StringT>());
+    for(; first != last; ++first) {
+        Policy::append(str, *first);
+    }
+}
+
+template <class Policy, class StringT, class InIter>
+void policy_append(StringT &str, InIter first, InIter last, std::true_type) {
+    if(Policy::empty(str)) {
+        Policy::assign(str, first, last);
+        return;
+    }
+
+    policy_append<Policy>(str, first, last, std::false_type());
+}
+
+template <class Policy, class StringT>
+void policy_clear(StringT &str, std::true_type) {
+    Policy::clear_keep_capacity(str);
+}
+
+template <class Policy, class StringT>
+void policy_clear(StringT &str, std::false_type) {
+    str = StringT();
+}
+
+} // namespace detail
+
+namespace detail {
+
+// Run of ordinary characters: stops at a quote and, outside quotes,
+// at a separator or (in strict mode) a newline
+
+template <class Iter, class CharT>
+Iter find_run_end(Iter first, Iter last, const CharT sep, const bool in_quotes,
+                  const bool stop_newline) {
+    return std::find_if(first, last, [&](const auto c) {
+        return c == '"' || (!in_quotes && (c == sep || (c == '\n' && stop_newline)));
+    });
+}
+
+inline unsigned count_trailing_zeros(const unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// Code unit types of the vectorized kernels, by character size
+template <std::size_t Size>
+struct code_unit;
+
+template <>
+struct code_unit<1> {
+    using type = unsigned char;
+};
+
+template <>
+struct code_unit<2> {
+    using type = char16_t;
+};
+
+template <>
+struct code_unit<4> {
+    using type = char32_t;
+};
+
+#ifdef SFCSV_SSE2
+inline __m128i simd_set1(const unsigned char c) {
+    return _mm_set1_epi8(static_cast<char>(c));
+}
+
+inline __m128i simd_set1(const char16_t c) {
+    return _mm_set1_epi16(static_cast<short>(c));
+}
+
+inline __m128i simd_set1(const char32_t c) {
+    return _mm_set1_epi32(static_cast<int>(c));
+}
+
+inline __m128i simd_cmpeq(const __m128i a, const __m128i b, unsigned char) {
+    return _mm_cmpeq_epi8(a, b);
+}
+
+inline __m128i simd_cmpeq(const __m128i a, const __m128i b, char16_t) {
+    return _mm_cmpeq_epi16(a, b);
+}
+
+inline __m128i simd_cmpeq(const __m128i a, const __m128i b, char32_t) {
+    return _mm_cmpeq_epi32(a, b);
+}
+#endif
+
+/**
+ * @brief Find the end of a run in contiguous code units
+ *
+ * Compares 16 bytes at a time with SSE2 when it is available.
+ */
+template <class Unit>
+const Unit *find_run_end(const Unit *first, const Unit *last, const Unit sep,
+                         const bool in_quotes, const bool stop_newline) {
+    // Characters that don't apply are replaced with a quote
+    const Unit q = '"';
+    const Unit s = in_quotes ? q : sep;
+    const Unit n = !in_quotes && stop_newline ? Unit('\n') : q;
+#ifdef SFCSV_SSE2
+    const std::ptrdiff_t step = sizeof(__m128i) / sizeof(Unit);
+    const auto quote_v = simd_set1(q);
+    const auto sep_v = simd_set1(s);
+    const auto newline_v = simd_set1(n);
+    for(; last - first >= step; first += step) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+        const auto hits = _mm_or_si128(_mm_or_si128(simd_cmpeq(v, quote_v, q),
+                                                    simd_cmpeq(v, sep_v, q)),
+                                       simd_cmpeq(v, newline_v, q));
+        const auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+        if(mask != 0) {
+            return first + count_trailing_zeros(mask) / sizeof(Unit);
+        }
+    }
+#endif
+    for(; first != last; ++first) {
+        const Unit c = *first;
+        if(c == q || c == s || c == n) {
+            return first;
+        }
+    }
+
+    return last;
+}
+
+template <class Unit, class T>
+std::enable_if_t<std::is_integral<T>::value, Unit> to_code_unit(const T c) {
+    return static_cast<Unit>(c);
+}
+
+// Character classes like QChar that hold one code unit
+template <class Unit, class T>
+std::enable_if_t<!std::is_integral<T>::value, Unit> to_code_unit(const T c) {
+    static_assert(sizeof(T) == sizeof(Unit), "Separator must have the size of a character");
+    Unit unit;
+    std::memcpy(&unit, &c, sizeof(unit));
+    return unit;
+}
+
+// Strings with 8, 16 or 32-bit characters stored contiguously,
+// e.g. std::string, std::u16string, std::u32string, std::wstring and QString
+template <class StringT, class = void>
+struct is_contiguous_string : std::false_type {};
+
+template <class StringT>
+struct is_contiguous_string<StringT, std::enable_if_t<
+        (sizeof(typename StringT::value_type) == 1 || sizeof(typename StringT::value_type) == 2
+         || sizeof(typename StringT::value_type) == 4)
+        && std::is_trivially_copyable<typename StringT::value_type>::value
+        && std::is_pointer<decltype(std::declval<const StringT &>().data())>::value>>
+    : std::true_type {};
+
+template <class StringT, class Iter, class CharT>
+Iter find_run_end(const StringT &, Iter first, Iter last, const CharT sep,
+                  const bool in_quotes, const bool stop_newline, std::false_type) {
+    return find_run_end(first, last, sep, in_quotes, stop_newline);
+}
+
+template <class StringT, class Iter, class CharT>
+Iter find_run_end(const StringT &s, Iter first, Iter last, const CharT sep,
+                  const bool in_quotes, const bool stop_newline, std::true_type) {
+    using unit = typename code_unit<sizeof(typename StringT::value_type)>::type;
+    const auto base = reinterpret_cast<const unit *>(s.data());
+    const auto begin = s.cbegin();
+    const auto run = base + (first - begin);
+    const auto found = find_run_end(run, base + (last - begin), to_code_unit<unit>(sep),
+                                    in_quotes, stop_newline);
+    return first + (found - run);
+}
+
+/**
+ * @brief Find the end of a run of ordinary characters in s
+ *
+ * Uses the vectorized kernels for strings of contiguous characters.
+ */
+template <class StringT, class Iter, class CharT>
+Iter find_run_end(const StringT &s, Iter first, Iter last, const CharT sep,
+                  const bool in_quotes, const bool stop_newline) {
+    return find_run_end(s, first, last, sep, in_quotes, stop_newline,
+                        is_contiguous_string<StringT>());
+}
+
+/**
+ * @brief Follows the quotes of a record one character at a time like parse_line() does
+ *
+ * In strict mode every odd run of quotes opens or closes a quoted field.
+ * In loose mode a quote in a non-empty unquoted field is literal, and so is
+ * an odd run in a quoted field that is followed by anything but a separator,
+ * a newline or the end of the text.
+ */
+template <class CharT>
+class quote_scanner {
+public:
+    quote_scanner(const CharT sep, const mode pmode, const bool in_quotes = false)
+        : _sep(sep), _mode(pmode), _in_quotes(in_quotes), _empty(!in_quotes) {}
+
+    /**
+     * @brief Scan the next character
+     * @return True if c is a separator or newline outside quotes
+     */
+    template <class C>
+    bool push(const C c) {
+        if(c == '"') {
+            if(_run != 0 || _in_quotes || _empty || _mode == mode::strict) {
+                ++_run;
+            }
+            return false;
+        }
+
+        const bool boundary = c == _sep || c == '\n';
+        end_run(boundary);
+        _empty = boundary && !_in_quotes;
+        return _empty;
+    }
+
+    /**
+     * @brief Resolve quotes left at the end of the text
+     */
+    void finish() {
+        end_run(true);
+    }
+
+    /**
+     * @return Whether the last character pushed is inside a quoted field,
+     *         only known after a character other than a quote or finish()
+     */
+    bool in_quotes() const {
+        return _in_quotes;
+    }
+
+private:
+    void end_run(const bool boundary) {
+        if(_run == 0) {
+            return;
+        }
+
+        const bool literal = _in_quotes && !boundary && _mode == mode::loose;
+        if(_run % 2 != 0 && !literal) {
+            _in_quotes = !_in_quotes;
+        }
+        _empty = false;
+        _run = 0;
+    }
+
+    CharT _sep;
+    mode _mode;
+    bool _in_quotes;
+    bool _empty;        // nothing but quotes in the current field yet
+    std::size_t _run = 0;  // quotes not resolved yet
 };
 
+} // namespace detail
+
+/**
+ * @brief Count the fields in a CSV record without decoding them
+ *
+ * Only quotes and separators are inspected, so this is much cheaper
+ * than parse_line(). Quotes are followed by the rules of pmode, so a
+ * record counts as many fields as parse_line() returns for it.
+ *
+ * @pre InIter must satisfy InputIterator
+ * @param first Iterator to the begin position
+ * @param last Iterator to the end position
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Number of fields
+ */
+template <class InIter, class CharT>
+std::size_t count_fields(InIter first, InIter last, const CharT sep = ',',
+                         const mode pmode = mode::strict) {
+    detail::quote_scanner<CharT> quotes(sep, pmode);
+    std::size_t fields = 1;
+    for(; first != last; ++first) {
+        const auto c = *first;
+        if(quotes.push(c) && c == sep) {
+            ++fields;
+        }
+    }
+
+    return fields;
+}
+
+/**
+ * @brief Find the first invalid UTF-8 sequence
+ *
+ * Rejects overlong encodings, surrogates and code points above U+10FFFF.
+ * ASCII is skipped 16 bytes at a time with SSE2 when it is available.
+ *
+ * @param data Bytes to validate
+ * @param size Number of bytes
+ * @return Offset of the first invalid sequence, or npos if all are valid
+ */
+inline std::size_t find_invalid_utf8(const char *data, const std::size_t size) {
+    const auto begin = reinterpret_cast<const unsigned char *>(data);
+    const auto end = begin + size;
+    auto p = begin;
+    while(p != end) {
+#ifdef SFCSV_SSE2
+        while(end - p >= 16 && _mm_movemask_epi8(
+                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) == 0) {
+            p += 16;
+        }
+        if(p == end) {
+            break;
+        }
+#endif
+        const unsigned c = *p;
+        if(c < 0x80) {
+            ++p;
+            continue;
+        }
+
+        // Sequence length and the valid range of the second byte
+        std::ptrdiff_t len = 0;
+        unsigned lo = 0x80;
+        unsigned hi = 0xbf;
+        if(c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+        }
+        else if(c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            lo = c == 0xe0 ? 0xa0 : 0x80;
+            hi = c == 0xed ? 0x9f : 0xbf;
+        }
+        else if(c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            lo = c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xf4 ? 0x8f : 0xbf;
+        }
+
+        if(len == 0 || end - p < len || p[1] < lo || p[1] > hi) {
+            return static_cast<std::size_t>(p - begin);
+        }
+        for(std::ptrdiff_t i = 2; i < len; ++i) {
+            if((p[i] & 0xc0) != 0x80) {
+                return static_cast<std::size_t>(p - begin);
+            }
+        }
+        p += len;
+    }
+
+    return npos;
+}
+
+/**
+ * @brief Find the first invalid UTF-8 sequence in a string of 8-bit characters
+ * @param s String to validate
+ * @return Offset of the first invalid sequence, or npos if all are valid
+ */
+template <class StringT>
+std::size_t find_invalid_utf8(const StringT &s) {
+    static_assert(sizeof(typename StringT::value_type) == 1, "UTF-8 needs 8-bit characters");
+    return find_invalid_utf8(reinterpret_cast<const char *>(s.data()), s.size());
+}
+
+namespace detail {
+
+template <class CharT>
+std::enable_if_t<std::is_integral<CharT>::value, char> to_ascii(const CharT c) {
+    return c >= 0 && c < 128 ? static_cast<char>(c) : '?';
+}
+
+template <class CharT>
+std::enable_if_t<!std::is_integral<CharT>::value, char> to_ascii(const CharT) {
+    return '?';
+}
+
+/**
+ * @brief Text around pos, at most 20 characters on each side
+ */
+template <class Iter>
+std::string excerpt(const Iter first, const Iter pos, const Iter last) {
+    const auto offset = static_cast<std::size_t>(std::distance(first, pos));
+    auto it = offset > 20 ? std::next(first, static_cast<std::ptrdiff_t>(offset - 20)) : first;
+    std::string result;
+    for(std::size_t i = 0; it != last && i <= 40; ++it, ++i) {
+        result += to_ascii(*it);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Start of field n of a line, or last if it has fewer fields
+ */
+template <class Iter, class CharT>
+Iter field_begin(Iter first, const Iter last, const CharT sep, const mode pmode, std::size_t n) {
+    quote_scanner<CharT> quotes(sep, pmode);
+    for(; first != last && n > 0; ++first) {
+        const auto c = *first;
+        if(quotes.push(c) && c == sep) {
+            --n;
+        }
+    }
+
+    return first;
+}
+
+/**
+ * @brief Make an error at pos in a line, only called on the error path
+ */
+template <class Iter, class CharT>
+csv_error line_error(const char *msg, const Iter first, const Iter pos, const Iter last,
+                     const CharT sep, const mode pmode = mode::strict) {
+    return csv_error(msg, npos, count_fields(first, pos, sep, pmode) - 1,
+                     static_cast<std::size_t>(std::distance(first, pos)),
+                     excerpt(first, pos, last));
+}
+
+} // namespace detail
+
 /**
  * @brief Parse a CSV line from string
  * @pre StringT must have cbegin()/cend() that satisfy InputIterator
- * @pre StringT must be default initializable
+ * @pre StringT must be default initializable and move assignable
  * @pre StringT must have value_type
+ * @pre StringPolicy must provide append() and empty() for StringT
+ *      (default_policy needs operator+=, .append(count, c) and .empty())
  * @pre OutIter must satisfy OutputIterator
  * @param s String to parse
  * @param out Output iterator
@@ -83,9 +738,14 @@ struct default_policy {
  * @throws std::runtime_error If newline character in non-quoted field (strict mode)
  */
 template <class StringPolicy = default_policy, class StringT, class OutIter,
-          class CharT = class StringT::value_type>
+          class CharT = typename StringT::value_type>
 void parse_line(const StringT& s, OutIter out, 
                 const CharT sep = ',', const mode pmode = mode::strict) {
+    using iterator = typename StringT::const_iterator;
+    using has_reserve = detail::has_reserve<StringPolicy, StringT>;
+    using has_assign = detail::has_assign<StringPolicy, StringT, iterator>;
+    using has_clear = detail::has_clear_keep_capacity<StringPolicy, StringT>;
+
     bool in_quotes = false;
     StringT field;    
     for(auto it = s.cbegin(), end = s.cend(); it != end; ++it) {
@@ -96,7 +756,8 @@ void parse_line(const StringT& s, OutIter out,
                     StringPolicy::append(field, '"');
                 }
                 else {
-                    throw csv_error("Double quotes not permitted in non-quoted fields");
+                    throw detail::line_error("Double quotes not permitted in non-quoted fields",
+                                             s.cbegin(), it, end, sep);
                 }
             }
             else {
@@ -127,7 +788,8 @@ void parse_line(const StringT& s, OutIter out,
                     it = last_quote;
                     if(!in_quotes && it != end && *(it) != sep && pmode == mode::strict) {
                         // If next character after field ending quote is not a separator
-                        throw csv_error("Invalid separator after a field");
+                        throw detail::line_error("Invalid separator after a field",
+                                                 s.cbegin(), it, end, sep);
                     }
                 }
 
@@ -137,10 +799,19 @@ void parse_line(const StringT& s, OutIter out,
         else if(c == sep && !in_quotes) {
             // Separator ends field
             *out++ = std::move(field);
-            field.clear();
+            detail::policy_clear<StringPolicy>(field, has_clear());
         }
         else if(c == '\n' && !in_quotes && pmode == mode::strict) {
-            throw csv_error("Newline characters are not permitted in non-quoted fields");
+            throw detail::line_error("Newline characters are not permitted in non-quoted fields",
+                                     s.cbegin(), it, end, sep);
+        }
+        else if(has_assign::value || has_reserve::value) {
+            // Add the whole run of ordinary characters at once
+            const auto run_end = detail::find_run_end(s, it, end, sep, in_quotes,
+                                                      pmode == mode::strict);
+            detail::policy_append<StringPolicy>(field, it, run_end, has_assign());
+            it = run_end;
+            --it;
         }
         else {
             StringPolicy::append(field, c);
@@ -151,48 +822,316 @@ void parse_line(const StringT& s, OutIter out,
     *out++ = std::move(field);
 }
 
+namespace detail {
+
 /**
- * @brief Encode a single string field
- *
- * This function duplicates all quote characters
- * and encloses the string with quote characters
+ * @brief Output iterator that stores parsed fields into a fixed-size array
  *
- * @pre StringT must have .reserve(size)
- * @pre StringT must have operator+=
- * @pre StringT must have .begin()/.end() that satisfy InputIterator
- * @pre StringT must be default initializable
- * @param s String to encode
- * @return Encoded string
+ * Fields past N are counted and dropped, so the caller can report where
+ * the first extra field starts.
  */
-template <class StringT>
-StringT encode_field(const StringT& s) {
-    StringT out;
-    // Reserve space for old string, enclosing quotes, and embedded quotes
-    out.reserve(s.size() + 2 + std::count(std::begin(s), std::end(s), '"'));
-    out += '"';
-    for(const auto c : s) {
-        out += c;
-        if(c == '"') {
-            out += c;
+template <class StringT, std::size_t N>
+class array_inserter {
+    std::array<StringT, N> *_arr;
+    std::size_t *_count;
+
+public:
+    array_inserter(std::array<StringT, N> &arr, std::size_t &count)
+        : _arr(&arr), _count(&count) {}
+
+    array_inserter& operator++() {
+        return *this;
+    }
+    array_inserter& operator++(int) {
+        return *this;
+    }
+    array_inserter& operator*() {
+        return *this;
+    }
+    array_inserter& operator=(StringT &&s) {
+        if(*_count < N) {
+            (*_arr)[*_count] = std::move(s);
         }
+        ++*_count;
+        return *this;
     }
+};
 
-    out += '"';
-    return out;
-}
+} // namespace detail
 
 /**
- * @brief Encode strings from iterator range start to end
- * @pre InIter must satisfy InputIterator
- * @pre OutIter must satisfy OutputIterator
- * @param start Iterator to the begin position
- * @param end Iterator to the end position
- * @param out Iterator to output
+ * @brief Parse a CSV line with exactly N fields
+ *
+ * Same as parse_line() but stores the fields in a std::array,
+ * which avoids growing a container for fixed-arity rows.
+ *
+ * @pre StringT must satisfy the parse_line() requirements
+ * @param s String to parse
  * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Parsed fields
+ * @throws csv_error If the line is invalid (see parse_line())
+ * @throws csv_error If the line does not have exactly N fields
  */
-template <class InIter, class OutIter, class CharT = char>
-void encode_line(InIter start, InIter end, OutIter out, const CharT* sep = ",") {
-    while(start != end) {
+template <std::size_t N, class StringPolicy = default_policy, class StringT,
+          class CharT = typename StringT::value_type>
+std::array<StringT, N> parse_line(const StringT& s, const CharT sep = ',',
+                                  const mode pmode = mode::strict) {
+    std::array<StringT, N> result;
+    std::size_t count = 0;
+    parse_line<StringPolicy>(s, detail::array_inserter<StringT, N>(result, count), sep, pmode);
+    if(count > N) {
+        throw detail::line_error("Too many fields in line", s.cbegin(),
+                                 detail::field_begin(s.cbegin(), s.cend(), sep, pmode, N),
+                                 s.cend(), sep, pmode);
+    }
+    if(count < N) {
+        throw detail::line_error("Too few fields in line", s.cbegin(), s.cend(), s.cend(), sep,
+                                 pmode);
+    }
+    return result;
+}
+
+/**
+ * @brief Field that refers to the source text and is decoded on demand
+ *
+ * Fields without embedded quotes refer directly to their value.
+ * Escaped fields refer to the raw field, including the enclosing quotes,
+ * and are only decoded (and allocated) when str() is called.
+ *
+ * The source text must outlive the field.
+ */
+template <class Iter, class CharT = typename std::iterator_traits<Iter>::value_type>
+class lazy_field {
+public:
+    lazy_field(Iter first, Iter last, const bool escaped, const bool quoted,
+               const CharT sep, const mode pmode)
+        : _first(first), _last(last), _escaped(escaped), _quoted(quoted),
+          _sep(sep), _mode(pmode) {}
+
+    /**
+     * @return Iterator to the value, or to the raw field if escaped()
+     */
+    Iter begin() const {
+        return _first;
+    }
+
+    /**
+     * @return Iterator to one past the value, or to one past the raw field if escaped()
+     */
+    Iter end() const {
+        return _last;
+    }
+
+    /**
+     * @return True if the field has to be decoded to get its value
+     */
+    bool escaped() const {
+        return _escaped;
+    }
+
+    /**
+     * @return True if the field starts with a quote, e.g. to tell "" from an empty field
+     */
+    bool quoted() const {
+        return _quoted;
+    }
+
+    /**
+     * @brief Get the decoded value
+     * @pre StringT must be constructible from an iterator range
+     * @return Field value
+     */
+    template <class StringT = std::basic_string<CharT>, class StringPolicy = default_policy>
+    StringT str() const {
+        if(!_escaped) {
+            return StringT(_first, _last);
+        }
+
+        return std::move(parse_line<1, StringPolicy>(StringT(_first, _last), _sep, _mode)[0]);
+    }
+
+private:
+    Iter _first;
+    Iter _last;
+    bool _escaped;
+    bool _quoted;
+    CharT _sep;
+    mode _mode;
+};
+
+/**
+ * @brief Split a CSV line into lazy fields
+ *
+ * Validates the line like parse_line() but does not decode or copy
+ * any fields. See lazy_field.
+ *
+ * @pre StringT must have cbegin()/cend() that satisfy BidirectionalIterator
+ * @pre StringT must have value_type
+ * @pre OutIter must satisfy OutputIterator for lazy_field<StringT::const_iterator>
+ * @param s String to split, must outlive the fields
+ * @param out Output iterator
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @throws csv_error Same as parse_line()
+ */
+template <class StringT, class OutIter, class CharT = typename StringT::value_type>
+void split_line(const StringT& s, OutIter out,
+                const CharT sep = ',', const mode pmode = mode::strict) {
+    using field_type = lazy_field<typename StringT::const_iterator, CharT>;
+
+    // Emit a field, stripping the enclosing quotes when nothing else needs decoding
+    const auto emit = [&](const auto first, const auto last, const std::size_t quotes) {
+        if(quotes == 0) {
+            *out++ = field_type(first, last, false, false, sep, pmode);
+        }
+        else if(quotes == 2 && *first == '"' && std::prev(last) != first
+                && *std::prev(last) == '"') {
+            *out++ = field_type(std::next(first), std::prev(last), false, true, sep, pmode);
+        }
+        else {
+            *out++ = field_type(first, last, true, *first == '"', sep, pmode);
+        }
+    };
+
+    // Mirrors the state machine of parse_line() without building the fields
+    bool in_quotes = false;
+    bool empty = true;
+    std::size_t quotes = 0;
+    auto field_start = s.cbegin();
+    for(auto it = s.cbegin(), end = s.cend(); it != end; ++it) {
+        const auto c = *it;
+        if(c == '"') {
+            if(!in_quotes && !empty) {
+                if(pmode == mode::loose) {
+                    ++quotes;
+                }
+                else {
+                    throw detail::line_error("Double quotes not permitted in non-quoted fields",
+                                             s.cbegin(), it, end, sep);
+                }
+            }
+            else {
+                const auto last_quote = std::find_if(it, end, [](const auto c){
+                    return c != '"';
+                });
+                const auto num_quotes = std::distance(it, last_quote);
+                const bool enclosing = num_quotes % 2 != 0;
+                quotes += num_quotes;
+
+                if(in_quotes && enclosing && last_quote != end
+                        && *(last_quote) != sep && pmode == mode::loose) {
+                    empty = false;
+                    it = last_quote;
+                }
+                else {
+                    const auto ignore_quotes = enclosing ? 1 : (empty ? 2 : 0);
+                    if(num_quotes > ignore_quotes) {
+                        empty = false;
+                    }
+
+                    if(enclosing) {
+                        in_quotes = !in_quotes;
+                    }
+
+                    it = last_quote;
+                    if(!in_quotes && it != end && *(it) != sep && pmode == mode::strict) {
+                        throw detail::line_error("Invalid separator after a field",
+                                                 s.cbegin(), it, end, sep);
+                    }
+                }
+
+                --it;
+            }
+        }
+        else if(c == sep && !in_quotes) {
+            emit(field_start, it, quotes);
+            field_start = std::next(it);
+            empty = true;
+            quotes = 0;
+        }
+        else if(c == '\n' && !in_quotes && pmode == mode::strict) {
+            throw detail::line_error("Newline characters are not permitted in non-quoted fields",
+                                     s.cbegin(), it, end, sep);
+        }
+        else {
+            // Skip the whole run of ordinary characters
+            empty = false;
+            it = std::prev(detail::find_run_end(s, it, end, sep, in_quotes,
+                                                pmode == mode::strict));
+        }
+    }
+
+    emit(field_start, s.cend(), quotes);
+}
+
+/**
+ * @brief Encode a single string field
+ *
+ * This function duplicates all quote characters
+ * and encloses the string with quote characters
+ *
+ * @pre StringT must have .reserve(size)
+ * @pre StringT must have operator+=
+ * @pre StringT must have .begin()/.end() that satisfy InputIterator
+ * @pre StringT must be default initializable
+ * @param s String to encode
+ * @return Encoded string
+ */
+template <class StringT>
+StringT encode_field(const StringT& s) {
+    StringT out;
+    // Reserve space for old string, enclosing quotes, and embedded quotes
+    out.reserve(s.size() + 2 + std::count(std::begin(s), std::end(s), '"'));
+    out += '"';
+    for(const auto c : s) {
+        out += c;
+        if(c == '"') {
+            out += c;
+        }
+    }
+
+    out += '"';
+    return out;
+}
+
+namespace detail {
+
+// Character type of the default separator of encode_line: the character
+// type of the strings if it is a built-in one, otherwise char
+template <class InIter, class = void>
+struct separator_char {
+    using type = char;
+};
+
+template <class InIter>
+struct separator_char<InIter, std::enable_if_t<std::is_integral<
+        typename std::iterator_traits<InIter>::value_type::value_type>::value>> {
+    using type = typename std::iterator_traits<InIter>::value_type::value_type;
+};
+
+template <class CharT>
+const CharT *comma() {
+    static const CharT sep[] = {',', 0};
+    return sep;
+}
+
+} // namespace detail
+
+/**
+ * @brief Encode strings from iterator range start to end
+ * @pre InIter must satisfy InputIterator
+ * @pre OutIter must satisfy OutputIterator
+ * @param start Iterator to the begin position
+ * @param end Iterator to the end position
+ * @param out Iterator to output
+ * @param sep Field separator
+ */
+template <class InIter, class OutIter,
+          class CharT = typename detail::separator_char<InIter>::type>
+void encode_line(InIter start, InIter end, OutIter out,
+                 const CharT* sep = detail::comma<CharT>()) {
+    while(start != end) {
         *out++ = encode_field(*start);
         if(++start != end) {
             *out++ = sep;
@@ -200,6 +1139,3759 @@ void encode_line(InIter start, InIter end, OutIter out, const CharT* sep = ",")
     }
 }
 
+/**
+ * @brief Read CSV records from an input stream
+ *
+ * Unlike std::getline, records with newlines inside quoted fields
+ * are read as a single record. The first record is the header.
+ *
+ * Offsets are counted in characters from the position of the
+ * stream when the reader was created.
+ */
+template <class CharT, class StringPolicy = default_policy>
+class basic_reader {
+public:
+    using string_type = std::basic_string<CharT>;
+    using stream_type = std::basic_istream<CharT>;
+
+    /**
+     * @param in Stream to read from
+     * @param sep Field separator
+     * @param pmode Parsing mode
+     * @param check Whether to check field counts against the header
+     */
+    explicit basic_reader(stream_type &in, const CharT sep = ',',
+                          const mode pmode = mode::strict,
+                          const column_check check = column_check::none)
+        : _in(in), _sep(sep), _mode(pmode), _check(check) {}
+
+    /**
+     * @brief Read the next raw record without decoding it
+     * @param record Record text without the trailing newline
+     * @return False if there are no more records
+     * @throws csv_error If the field count differs from the header's (column_check::enforce)
+     */
+    bool read_record(string_type &record) {
+        if(_cancel != nullptr && _offset >= _next_check) {
+            _cancel->check();
+            _next_check = _offset + detail::cancellation_block;
+        }
+
+        if(!read_line(record, _max_record_size)) {
+            return false;
+        }
+
+        _record_offset = _offset;
+        _offset += record.size() + (_in.eof() ? 0 : 1);
+
+        // Keep reading while a quoted field is open, scanning only the new lines
+        detail::quote_scanner<CharT> quotes(_sep, _mode);
+        scan_line(record.cbegin(), record.cend(), quotes);
+        string_type line;
+        while(quotes.in_quotes() && read_line(line, continuation_limit(record.size()))) {
+            record += '\n';
+            record += line;
+            scan_line(line.cbegin(), line.cend(), quotes);
+            _offset += line.size() + (_in.eof() ? 0 : 1);
+        }
+
+        if(_validate_utf8) {
+            check_utf8(record, std::integral_constant<bool, sizeof(CharT) == 1>());
+        }
+
+        if(_check != column_check::none) {
+            check_columns(record);
+        }
+
+        ++_records;
+        return true;
+    }
+
+    /**
+     * @brief Check that records are valid UTF-8 while reading them
+     *
+     * Records are validated right after they are read, while they
+     * are still in the cache. Only for streams of 8-bit characters.
+     *
+     * @param enable Whether to validate
+     */
+    void set_utf8_validation(const bool enable) {
+        static_assert(sizeof(CharT) == 1, "UTF-8 needs 8-bit characters");
+        _validate_utf8 = enable;
+    }
+
+    /**
+     * @brief Limit the size of a record
+     *
+     * Reading stops as soon as a record gets longer than this, so an
+     * unbalanced quote can't make the reader consume the rest of the stream.
+     *
+     * @param size Maximum size in characters, npos for no limit
+     */
+    void set_max_record_size(const std::size_t size) {
+        _max_record_size = size;
+    }
+
+    /**
+     * @brief Stop reading when a cancellation is cancelled
+     *
+     * Checked about every 64 KiB of input, reading then throws cancelled_error.
+     *
+     * @param cancel Cancellation that must outlive the reader, or nullptr
+     */
+    void set_cancellation(const cancellation *cancel) {
+        _cancel = cancel;
+    }
+
+    /**
+     * @brief Read and parse the next record
+     * @pre OutIter must satisfy OutputIterator
+     * @param out Output iterator
+     * @return False if there are no more records
+     * @throws csv_error If the record is invalid (see parse_line())
+     */
+    template <class OutIter>
+    bool read_row(OutIter out) {
+        if(!read_record(_record)) {
+            return false;
+        }
+
+        try {
+            parse_line<StringPolicy>(_record, out, _sep, _mode);
+        }
+        catch(const csv_error &e) {
+            throw record_error(e);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Read the next record and split it into lazy fields
+     *
+     * The fields refer to the reader's buffer and are only valid
+     * until the next record is read.
+     *
+     * @pre OutIter must satisfy OutputIterator for lazy_field
+     * @param out Output iterator
+     * @return False if there are no more records
+     * @throws csv_error If the record is invalid (see split_line())
+     */
+    template <class OutIter>
+    bool read_fields(OutIter out) {
+        if(!read_record(_record)) {
+            return false;
+        }
+
+        try {
+            split_line(_record, out, _sep, _mode);
+        }
+        catch(const csv_error &e) {
+            throw record_error(e);
+        }
+        return true;
+    }
+
+    /**
+     * @return Number of records read so far, including the header
+     */
+    std::size_t record_number() const {
+        return _records;
+    }
+
+    /**
+     * @return Offset of the last record read
+     */
+    std::size_t record_offset() const {
+        return _record_offset;
+    }
+
+    /**
+     * @return Records with a different field count than the header (column_check::report)
+     */
+    const std::vector<ragged_record>& ragged() const {
+        return _ragged;
+    }
+
+private:
+    // Streams of char and wchar_t have the ctype facets std::getline needs
+    using has_getline = std::integral_constant<bool, std::is_same<CharT, char>::value
+                                                     || std::is_same<CharT, wchar_t>::value>;
+
+    // Reads at most limit characters, std::getline is only used without a limit
+    bool read_line(string_type &line, const std::size_t limit) {
+        if(limit == npos) {
+            return read_line(line, has_getline(), limit);
+        }
+        return read_line(line, std::false_type(), limit);
+    }
+
+    bool read_line(string_type &line, std::true_type, std::size_t) {
+        return static_cast<bool>(std::getline(_in, line));
+    }
+
+    // Same as std::getline but reads the stream buffer directly
+    bool read_line(string_type &line, std::false_type, const std::size_t limit) {
+        using traits = typename stream_type::traits_type;
+        line.clear();
+        const typename stream_type::sentry ok(_in, true);
+        if(!ok) {
+            return false;
+        }
+
+        auto *buf = _in.rdbuf();
+        for(auto c = buf->sbumpc(); ; c = buf->sbumpc()) {
+            if(traits::eq_int_type(c, traits::eof())) {
+                _in.setstate(line.empty() ? std::ios::eofbit | std::ios::failbit
+                                          : std::ios::eofbit);
+                return !line.empty();
+            }
+            if(traits::to_char_type(c) == '\n') {
+                return true;
+            }
+            if(line.size() >= limit) {
+                throw csv_error("Record is longer than the maximum size", _records, npos,
+                                _offset, detail::excerpt(line.cbegin(), line.cbegin(), line.cend()));
+            }
+            line += traits::to_char_type(c);
+        }
+    }
+
+    /**
+     * @brief Room left for a continuation line of a record
+     *
+     * Stays npos without a limit so read_line() keeps using getline().
+     */
+    std::size_t continuation_limit(const std::size_t record_size) const {
+        if(_max_record_size == npos) {
+            return npos;
+        }
+        return _max_record_size - std::min(_max_record_size, record_size + 1);
+    }
+
+    // Follow the quotes of a line and the newline after it
+    template <class Iter>
+    static void scan_line(Iter it, const Iter end, detail::quote_scanner<CharT> &quotes) {
+        for(; it != end; ++it) {
+            quotes.push(*it);
+        }
+        quotes.push('\n');
+    }
+
+    void check_utf8(const string_type &record, std::true_type) const {
+        const auto pos = find_invalid_utf8(record);
+        if(pos != npos) {
+            const auto it = record.cbegin() + static_cast<std::ptrdiff_t>(pos);
+            throw csv_error("Invalid UTF-8", _records,
+                            count_fields(record.cbegin(), it, _sep, _mode) - 1, _record_offset + pos,
+                            detail::excerpt(record.cbegin(), it, record.cend()));
+        }
+    }
+
+    void check_utf8(const string_type &, std::false_type) const {
+    }
+
+    // Add the position of the last record to an error from parsing it
+    csv_error record_error(const csv_error &e) const {
+        return csv_error(e.what(), _records - 1, e.field(), _record_offset + e.offset(),
+                         e.excerpt());
+    }
+
+    void check_columns(const string_type &record) {
+        const auto fields = count_fields(record.cbegin(), record.cend(), _sep, _mode);
+        if(_records == 0) {
+            _columns = fields;
+        }
+        else if(fields != _columns) {
+            if(_check == column_check::enforce) {
+                throw csv_error("Record has a different number of fields than the header",
+                                _records, npos, _record_offset,
+                                detail::excerpt(record.cbegin(), record.cbegin(), record.cend()));
+            }
+            _ragged.push_back({_records, _record_offset, fields});
+        }
+    }
+
+    stream_type &_in;
+    const CharT _sep;
+    const mode _mode;
+    const column_check _check;
+    string_type _record;
+    std::size_t _records = 0;
+    std::size_t _offset = 0;
+    std::size_t _record_offset = 0;
+    std::size_t _columns = 0;
+    std::vector<ragged_record> _ragged;
+    bool _validate_utf8 = false;
+    std::size_t _max_record_size = npos;
+    const cancellation *_cancel = nullptr;
+    std::size_t _next_check = 0;
+};
+
+using reader = basic_reader<char>;
+
+/**
+ * @brief Parse the header and the first records of a stream
+ *
+ * Stops reading right after the last requested record, so only the
+ * start of the stream is read. Records are limited in size, so a broken
+ * quote doesn't make it read the whole stream either.
+ *
+ * @param in Stream to read from
+ * @param n Number of records after the header
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @param max_record_size Maximum size of a record in bytes
+ * @return Header and up to n rows
+ * @throws csv_error If a record is invalid or too long
+ */
+inline std::vector<std::vector<std::string>> head(std::istream &in, const std::size_t n,
+                                                  const char sep = ',',
+                                                  const mode pmode = mode::strict,
+                                                  const std::size_t max_record_size = 1 << 20) {
+    reader r(in, sep, pmode);
+    r.set_max_record_size(max_record_size);
+    std::vector<std::vector<std::string>> rows;
+    while(rows.size() <= n) {
+        rows.emplace_back();
+        if(!r.read_row(std::back_inserter(rows.back()))) {
+            rows.pop_back();
+            break;
+        }
+    }
+    return rows;
+}
+
+/**
+ * @brief Find records whose field count differs from the header's
+ *
+ * Records are only scanned for quotes and separators, not decoded.
+ *
+ * @param in Stream to read from
+ * @param sep Field separator
+ * @return Offending records
+ */
+template <class CharT>
+std::vector<ragged_record> find_ragged(std::basic_istream<CharT> &in, const CharT sep = ',') {
+    basic_reader<CharT> r(in, sep, mode::strict, column_check::report);
+    std::basic_string<CharT> record;
+    while(r.read_record(record)) {
+    }
+
+    return r.ragged();
+}
+
+/**
+ * @brief Encodings utf8_streambuf can read
+ */
+enum class encoding {
+    automatic,  // detect from the byte order mark, UTF-8 without one
+    utf8,
+    latin1,
+    cp1252,
+    utf16le,
+    utf16be
+};
+
+namespace detail {
+
+// Windows-1252 code points for 0x80-0x9f, unassigned bytes map as in Latin-1
+const char16_t cp1252_high[32] = {
+    0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+    0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+    0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+    0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178
+};
+
+inline char *put_utf8(char *out, const char32_t cp) {
+    if(cp < 0x80) {
+        *out++ = static_cast<char>(cp);
+    }
+    else if(cp < 0x800) {
+        *out++ = static_cast<char>(0xc0 | (cp >> 6));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else if(cp < 0x10000) {
+        *out++ = static_cast<char>(0xe0 | (cp >> 12));
+        *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else {
+        *out++ = static_cast<char>(0xf0 | (cp >> 18));
+        *out++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    return out;
+}
+
+/**
+ * @brief Transcode Latin-1 or Windows-1252 to UTF-8
+ * @param high Code points for 0x80-0x9f, or nullptr for Latin-1
+ * @return One past the last byte written, at most 3 * (last - first) bytes
+ */
+inline char *transcode_8bit(const unsigned char *first, const unsigned char *last, char *out,
+                            const char16_t *high) {
+    while(first != last) {
+#ifdef SFCSV_SSE2
+        while(last - first >= 16) {
+            const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+            if(_mm_movemask_epi8(v) != 0) {
+                break;
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out), v);
+            first += 16;
+            out += 16;
+        }
+        if(first == last) {
+            break;
+        }
+#endif
+        const unsigned char c = *first++;
+        out = put_utf8(out, high && c >= 0x80 && c < 0xa0 ? high[c - 0x80] : c);
+    }
+    return out;
+}
+
+/**
+ * @brief Transcode UTF-16 to UTF-8, replacing unpaired surrogates with U+FFFD
+ *
+ * Stops before an odd trailing byte or a high surrogate whose pair is
+ * not in the input yet, unless final is set.
+ *
+ * @return One past the last byte written, at most 3 / 2 * (last - first) + 3 bytes
+ */
+inline char *transcode_utf16(const unsigned char *&first, const unsigned char *last, char *out,
+                             const bool big_endian, const bool final) {
+    const auto unit = [big_endian](const unsigned char *p) -> char32_t {
+        return big_endian ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+    };
+
+    while(last - first >= 2) {
+#ifdef SFCSV_SSE2
+        // Eight ASCII units at a time
+        while(last - first >= 16) {
+            auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+            if(big_endian) {
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            }
+            if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(
+                    static_cast<short>(0xff80))), _mm_setzero_si128())) != 0xffff) {
+                break;
+            }
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(v, v));
+            first += 16;
+            out += 8;
+        }
+        if(last - first < 2) {
+            break;
+        }
+#endif
+        const auto cp = unit(first);
+        if(cp >= 0xd800 && cp < 0xdc00) {
+            if(last - first < 4) {
+                if(!final) {
+                    break;
+                }
+                out = put_utf8(out, 0xfffd);
+                first += 2;
+                continue;
+            }
+            const auto low = unit(first + 2);
+            if(low >= 0xdc00 && low < 0xe000) {
+                out = put_utf8(out, 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00));
+                first += 4;
+                continue;
+            }
+        }
+        out = put_utf8(out, cp >= 0xd800 && cp < 0xe000 ? 0xfffd : cp);
+        first += 2;
+    }
+
+    if(final && first != last) {
+        out = put_utf8(out, 0xfffd);
+        first = last;
+    }
+    return out;
+}
+
+} // namespace detail
+
+/**
+ * @brief Stream buffer that transcodes a byte stream to UTF-8
+ *
+ * The source is read and transcoded in blocks, so a reader on top of it
+ * parses UTF-8 without a separate conversion pass. Blocks of pure ASCII
+ * are copied 16 bytes at a time. A UTF-8 or matching UTF-16 byte order
+ * mark is skipped.
+ *
+ * @code
+ * std::ifstream file("partner.csv", std::ios::binary);
+ * sfcsv::utf8_streambuf buf(file, sfcsv::encoding::cp1252);
+ * std::istream in(&buf);
+ * sfcsv::reader r(in);
+ * @endcode
+ */
+class utf8_streambuf : public std::streambuf {
+public:
+    /**
+     * @param in Stream to read bytes from
+     * @param enc Encoding of the source
+     * @param block_size Number of bytes read from the source at once
+     */
+    explicit utf8_streambuf(std::istream &in, const encoding enc = encoding::automatic,
+                            const std::size_t block_size = 1 << 16)
+        : _in(in), _enc(enc), _raw(std::max<std::size_t>(block_size, 16) + 4),
+          _out(_raw.size() * 3 + 4) {}
+
+    utf8_streambuf(const utf8_streambuf &) = delete;
+    utf8_streambuf& operator=(const utf8_streambuf &) = delete;
+
+    /**
+     * @brief Encoding of the source, known after the first read
+     */
+    encoding source_encoding() const {
+        return _enc;
+    }
+
+protected:
+    int_type underflow() override {
+        while(gptr() == egptr()) {
+            if(_eof) {
+                return traits_type::eof();
+            }
+
+            _in.read(_raw.data() + _pending, static_cast<std::streamsize>(_raw.size() - 4 - _pending));
+            const auto size = _pending + static_cast<std::size_t>(_in.gcount());
+            _eof = size == _pending;
+            auto first = reinterpret_cast<const unsigned char *>(_raw.data());
+            const auto last = first + size;
+            if(!_started && (size >= 3 || _eof)) {
+                first += skip_bom(first, size);
+                _started = true;
+            }
+            else if(!_started) {
+                _pending = size;
+                continue;
+            }
+
+            char *end = _out.data();
+            switch(_enc) {
+            case encoding::latin1:
+                end = detail::transcode_8bit(first, last, end, nullptr);
+                first = last;
+                break;
+            case encoding::cp1252:
+                end = detail::transcode_8bit(first, last, end, detail::cp1252_high);
+                first = last;
+                break;
+            case encoding::utf16le:
+            case encoding::utf16be:
+                end = detail::transcode_utf16(first, last, end, _enc == encoding::utf16be, _eof);
+                break;
+            default:
+                end = std::copy(first, last, end);
+                first = last;
+                break;
+            }
+
+            // Keep the bytes of an incomplete UTF-16 sequence for the next block
+            _pending = static_cast<std::size_t>(last - first);
+            std::memmove(_raw.data(), first, _pending);
+            setg(_out.data(), _out.data(), end);
+        }
+
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    std::size_t skip_bom(const unsigned char *p, const std::size_t size) {
+        const bool utf8 = size >= 3 && p[0] == 0xef && p[1] == 0xbb && p[2] == 0xbf;
+        const bool le = size >= 2 && p[0] == 0xff && p[1] == 0xfe;
+        const bool be = size >= 2 && p[0] == 0xfe && p[1] == 0xff;
+        if(_enc == encoding::automatic) {
+            _enc = le ? encoding::utf16le : be ? encoding::utf16be : encoding::utf8;
+        }
+
+        if(utf8 && _enc == encoding::utf8) {
+            return 3;
+        }
+        if((le && _enc == encoding::utf16le) || (be && _enc == encoding::utf16be)) {
+            return 2;
+        }
+        return 0;
+    }
+
+    std::istream &_in;
+    encoding _enc;
+    std::vector<char> _raw;
+    std::vector<char> _out;
+    std::size_t _pending = 0;
+    bool _started = false;
+    bool _eof = false;
+};
+
+namespace detail {
+
+// Newline that ends a record, or last, updating in_quotes to the state there
+inline const char *scan_record_end(const char *first, const char *last, bool &in_quotes) {
+    using unit = code_unit<1>::type;
+    auto it = reinterpret_cast<const unit *>(first);
+    const auto end = reinterpret_cast<const unit *>(last);
+    for(;;) {
+        // Stops at quotes, and outside quotes at newlines
+        it = find_run_end(it, end, unit('\n'), in_quotes, false);
+        if(it == end || *it == '\n') {
+            return reinterpret_cast<const char *>(it);
+        }
+        in_quotes = !in_quotes;
+        ++it;
+    }
+}
+
+// Newline that ends a record, or last. Loose mode follows the quotes one
+// character at a time, strict mode only needs their parity.
+inline const char *find_record_end(const char *first, const char *last, bool in_quotes,
+                                   const char sep = ',', const mode pmode = mode::strict) {
+    if(pmode == mode::strict) {
+        return scan_record_end(first, last, in_quotes);
+    }
+
+    quote_scanner<char> quotes(sep, pmode, in_quotes);
+    for(auto it = first; it != last; ++it) {
+        if(quotes.push(*it) && *it == '\n') {
+            return it;
+        }
+    }
+    return last;
+}
+
+/**
+ * @brief Minimal string over a range of characters, for splitting records in place
+ */
+struct char_range {
+    using value_type = char;
+    using const_iterator = const char *;
+
+    const char *first;
+    const char *last;
+
+    const_iterator cbegin() const {
+        return first;
+    }
+    const_iterator cend() const {
+        return last;
+    }
+    const char *data() const {
+        return first;
+    }
+    std::size_t size() const {
+        return static_cast<std::size_t>(last - first);
+    }
+};
+
+} // namespace detail
+
+/**
+ * @brief Find the end of the record that starts at first
+ *
+ * Newlines inside quoted fields don't end the record. Quotes are
+ * followed by the rules of pmode, like basic_reader does.
+ *
+ * @param first Start of a record
+ * @param last End of the buffer
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Newline that ends the record, or last
+ */
+inline const char *find_record_end(const char *first, const char *last, const char sep = ',',
+                                   const mode pmode = mode::strict) {
+    return detail::find_record_end(first, last, false, sep, pmode);
+}
+
+/**
+ * @brief Call a function for every record in a buffer, on several threads
+ *
+ * The buffer is split into one chunk per thread. In strict mode the quotes
+ * in each chunk are counted first, so every thread knows whether its chunk
+ * starts inside a quoted field and where the first record that starts in it
+ * begins. In loose mode a quote's meaning depends on what comes before it,
+ * so the chunk bounds are found by following the records from the start,
+ * which costs one sequential pass over the quotes.
+ *
+ * @pre fn must be callable as fn(unsigned worker, const char *first, const char *last)
+ *      from several threads at once
+ * @param first Start of the buffer
+ * @param last End of the buffer
+ * @param fn Called with the range of each record, without the newline, and the
+ *           index of the thread (less than threads). Each thread sees its records in order.
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @param threads Number of threads
+ * @param cancel Cancellation checked by every thread about every 64 KiB, or nullptr
+ * @throws Whatever fn throws, the other threads stop at their next check
+ * @throws cancelled_error If cancelled
+ */
+template <class Fn>
+void parallel_for_each_record(const char *first, const char *last, Fn fn,
+                              const char sep = ',', const mode pmode = mode::strict,
+                              const unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+                              const cancellation *cancel = nullptr) {
+    const unsigned n = std::max(1u, threads);
+    const auto size = static_cast<std::uint64_t>(last - first);
+    std::vector<const char *> bounds;
+    for(unsigned i = 0; i <= n; ++i) {
+        bounds.push_back(first + static_cast<std::ptrdiff_t>(size * i / n));
+    }
+
+    std::atomic<bool> failed{false};
+    const auto stopped = [&failed, cancel]() {
+        return failed.load(std::memory_order_relaxed) || (cancel != nullptr && cancel->cancelled());
+    };
+
+    if(pmode == mode::loose) {
+        // Move each bound to the first record that starts at or after it
+        auto it = first;
+        auto next_check = first;
+        for(unsigned i = 1; i < n; ++i) {
+            while(it < bounds[i]) {
+                if(cancel != nullptr && it >= next_check) {
+                    cancel->check();
+                    next_check = it + std::min<std::ptrdiff_t>(last - it, detail::cancellation_block);
+                }
+                const auto end = detail::find_record_end(it, last, false, sep, pmode);
+                it = end == last ? last : end + 1;
+            }
+            bounds[i] = it;
+        }
+    }
+    else {
+        std::vector<std::future<std::ptrdiff_t>> quotes;
+        for(unsigned i = 0; i < n; ++i) {
+            quotes.push_back(std::async(std::launch::async, [&stopped](const char *f, const char *l) {
+                std::ptrdiff_t count = 0;
+                while(f != l && !stopped()) {
+                    const auto block_end = f + std::min<std::ptrdiff_t>(l - f, detail::cancellation_block);
+                    count += std::count(f, block_end, '"');
+                    f = block_end;
+                }
+                return count;
+            }, bounds[i], bounds[i + 1]));
+        }
+        for(auto &q : quotes) {
+            q.wait();
+        }
+        if(cancel != nullptr) {
+            cancel->check();
+        }
+
+        // Move each bound to the first record that starts at or after it
+        bool in_quotes = false;
+        for(unsigned i = 1; i < n; ++i) {
+            in_quotes = in_quotes != (quotes[i - 1].get() % 2 != 0);
+            if(bounds[i] != first && (bounds[i][-1] != '\n' || in_quotes)) {
+                const auto end = detail::find_record_end(bounds[i], last, in_quotes);
+                bounds[i] = end == last ? last : end + 1;
+            }
+            bounds[i] = std::max(bounds[i], bounds[i - 1]);
+        }
+    }
+
+    std::vector<std::future<void>> workers;
+    for(unsigned i = 0; i < n; ++i) {
+        workers.push_back(std::async(std::launch::async, [&, i]() {
+            try {
+                auto next_check = bounds[i];
+                for(auto it = bounds[i]; it < bounds[i + 1]; ) {
+                    if(it >= next_check) {
+                        if(cancel != nullptr) {
+                            cancel->check();
+                        }
+                        if(failed.load(std::memory_order_relaxed)) {
+                            return;
+                        }
+                        next_check = it + std::min<std::ptrdiff_t>(last - it, detail::cancellation_block);
+                    }
+
+                    const auto end = detail::find_record_end(it, last, false, sep, pmode);
+                    fn(i, it, end);
+                    it = end == last ? last : end + 1;
+                }
+            }
+            catch(...) {
+                failed.store(true, std::memory_order_relaxed);
+                throw;
+            }
+        }));
+    }
+
+    for(auto &w : workers) {
+        w.wait();
+    }
+    for(auto &w : workers) {
+        w.get();
+    }
+}
+
+/**
+ * @brief Totals of a parallel scan
+ */
+struct scan_stats {
+    std::uint64_t rows = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t errors = 0;
+    std::vector<std::uint64_t> nulls;  // per column
+};
+
+/**
+ * @brief Per-thread counters of a parallel scan
+ *
+ * Every thread updates only its own block of counters, and the blocks are
+ * at least a cache line apart, so counting doesn't make threads contend.
+ * Each counter has a single writer and is updated without read-modify-write
+ * instructions. Totals are merged by summing the blocks, which any thread
+ * can do at any time, also while the scan is running.
+ */
+class scan_counters {
+public:
+    /**
+     * @brief Counters of one thread
+     */
+    class local {
+    public:
+        /**
+         * @brief Count a row
+         * @param bytes Size of the row including the newline
+         */
+        void add_row(const std::uint64_t bytes) {
+            add(0, 1);
+            add(1, bytes);
+        }
+
+        /**
+         * @brief Count a row that could not be parsed
+         * @param bytes Size of the row including the newline
+         */
+        void add_error(const std::uint64_t bytes) {
+            add(2, 1);
+            add(1, bytes);
+        }
+
+        /**
+         * @brief Count a null field, columns past the configured ones are ignored
+         */
+        void add_null(const std::size_t column) {
+            if(column < _columns) {
+                add(3 + column, 1);
+            }
+        }
+
+    private:
+        friend class scan_counters;
+
+        local(std::atomic<std::uint64_t> *counters, const std::size_t columns)
+            : _counters(counters), _columns(columns) {}
+
+        void add(const std::size_t i, const std::uint64_t n) {
+            auto &c = _counters[i];
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        std::atomic<std::uint64_t> *_counters;
+        std::size_t _columns;
+    };
+
+    /**
+     * @param columns Number of columns to count nulls for
+     * @param threads Number of threads
+     */
+    explicit scan_counters(const std::size_t columns = 0,
+                           const unsigned threads = std::max(1u, std::thread::hardware_concurrency()))
+        : _columns(columns), _threads(std::max(1u, threads)),
+          _stride((3 + columns + 7) / 8 * 8 + 8),
+          _counters(new std::atomic<std::uint64_t>[_stride * _threads]()) {}
+
+    /**
+     * @return Number of threads
+     */
+    unsigned threads() const {
+        return _threads;
+    }
+
+    /**
+     * @return Counters for the thread with the given index
+     */
+    local local_counters(const unsigned worker) {
+        return local(&_counters[_stride * worker], _columns);
+    }
+
+    /**
+     * @brief Merge the counters of all threads
+     */
+    scan_stats snapshot() const {
+        scan_stats stats;
+        stats.nulls.resize(_columns);
+        for(unsigned w = 0; w < _threads; ++w) {
+            const auto *c = &_counters[_stride * w];
+            stats.rows += c[0].load(std::memory_order_relaxed);
+            stats.bytes += c[1].load(std::memory_order_relaxed);
+            stats.errors += c[2].load(std::memory_order_relaxed);
+            for(std::size_t i = 0; i < _columns; ++i) {
+                stats.nulls[i] += c[3 + i].load(std::memory_order_relaxed);
+            }
+        }
+        return stats;
+    }
+
+private:
+    const std::size_t _columns;
+    const unsigned _threads;
+    const std::size_t _stride;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> _counters;
+};
+
+/**
+ * @brief Split every row of a buffer into lazy fields, on several threads
+ *
+ * The first record is the header and is skipped. Rows that can't be
+ * parsed are counted as errors and skipped. Empty non-quoted fields
+ * are counted as nulls.
+ *
+ * @pre fn must be callable as
+ *      fn(unsigned worker, const std::vector<lazy_field<const char *>> &fields)
+ *      from several threads at once
+ * @param first Start of the buffer
+ * @param last End of the buffer
+ * @param fn Called with the fields of each row and the index of the thread
+ * @param counters Counters to update, also sets the number of threads
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @param cancel Cancellation to check, or nullptr
+ * @throws Whatever fn throws
+ * @throws cancelled_error If cancelled
+ */
+template <class Fn>
+void parallel_for_each_row(const char *first, const char *last, Fn fn, scan_counters &counters,
+                           const char sep = ',', const mode pmode = mode::strict,
+                           const cancellation *cancel = nullptr) {
+    const auto header_end = find_record_end(first, last, sep, pmode);
+    const auto body = header_end == last ? last : header_end + 1;
+
+    std::vector<std::vector<lazy_field<const char *>>> rows(counters.threads());
+    parallel_for_each_record(body, last, [&](const unsigned worker, const char *rfirst,
+                                             const char *rlast) {
+        auto local = counters.local_counters(worker);
+        const auto bytes = static_cast<std::uint64_t>(rlast - rfirst) + (rlast != last ? 1 : 0);
+        auto &row = rows[worker];
+        row.clear();
+        try {
+            split_line(detail::char_range{rfirst, rlast}, std::back_inserter(row), sep, pmode);
+        }
+        catch(const csv_error &) {
+            local.add_error(bytes);
+            return;
+        }
+
+        local.add_row(bytes);
+        for(std::size_t i = 0; i < row.size(); ++i) {
+            if(row[i].begin() == row[i].end() && !row[i].quoted()) {
+                local.add_null(i);
+            }
+        }
+        fn(worker, static_cast<const std::vector<lazy_field<const char *>> &>(row));
+    }, sep, pmode, counters.threads(), cancel);
+}
+
+/**
+ * @brief Identifies the contents of a source file for cache validation
+ *
+ * The hash covers the size and the first and last 64 KiB of the source,
+ * so mtime should be set as well to detect edits in the middle.
+ */
+struct source_signature {
+    std::uint64_t size = 0;
+    std::uint64_t mtime = 0;
+    std::uint64_t hash = 0;
+};
+
+inline bool operator==(const source_signature &a, const source_signature &b) {
+    return a.size == b.size && a.mtime == b.mtime && a.hash == b.hash;
+}
+
+inline bool operator!=(const source_signature &a, const source_signature &b) {
+    return !(a == b);
+}
+
+namespace detail {
+
+inline std::uint64_t fnv1a(const char *data, const std::size_t size,
+                           std::uint64_t hash = 14695981039346656037ULL) {
+    for(std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+template <class T>
+void write_pod(std::ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <class T>
+void write_pods(std::ostream &out, const std::vector<T> &values) {
+    out.write(reinterpret_cast<const char *>(values.data()),
+              static_cast<std::streamsize>(values.size() * sizeof(T)));
+}
+
+template <class T>
+bool read_pod(std::istream &in, T &value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+// Read count values, growing the buffer only as the data arrives so a
+// corrupt count fails at the end of the stream instead of being allocated
+template <class Buffer>
+bool read_values(std::istream &in, Buffer &buf, const std::uint64_t count) {
+    using value_type = typename Buffer::value_type;
+    const std::uint64_t chunk = (1 << 20) / sizeof(value_type);
+    buf.clear();
+    while(buf.size() < count) {
+        const auto pos = buf.size();
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(count - pos, chunk));
+        buf.resize(pos + n);
+        if(!in.read(reinterpret_cast<char *>(&buf[pos]),
+                    static_cast<std::streamsize>(n * sizeof(value_type)))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <class T>
+bool read_pods(std::istream &in, std::vector<T> &values, const std::uint64_t count) {
+    return read_values(in, values, count);
+}
+
+inline void write_string(std::ostream &out, const std::string &str) {
+    write_pod(out, static_cast<std::uint64_t>(str.size()));
+    out.write(str.data(), static_cast<std::streamsize>(str.size()));
+}
+
+inline bool read_string(std::istream &in, std::string &str) {
+    std::uint64_t len = 0;
+    if(!read_pod(in, len)) {
+        return false;
+    }
+    return read_values(in, str, len);
+}
+
+// Sidecars start with a magic, version, byte order and the source signature
+inline void write_sidecar_header(std::ostream &out, const char *magic,
+                                 const std::uint32_t version, const source_signature &sig) {
+    const std::uint32_t byte_order = 0x01020304;
+    out.write(magic, 4);
+    write_pod(out, version);
+    write_pod(out, byte_order);
+    write_pod(out, sig.size);
+    write_pod(out, sig.mtime);
+    write_pod(out, sig.hash);
+}
+
+inline bool read_sidecar_header(std::istream &in, const char *magic,
+                                const std::uint32_t version, const source_signature &sig) {
+    char stored_magic[4];
+    std::uint32_t stored_version = 0;
+    std::uint32_t byte_order = 0;
+    source_signature stored;
+    return in.read(stored_magic, 4) && std::equal(stored_magic, stored_magic + 4, magic)
+            && read_pod(in, stored_version) && stored_version == version
+            && read_pod(in, byte_order) && byte_order == 0x01020304
+            && read_pod(in, stored.size) && read_pod(in, stored.mtime)
+            && read_pod(in, stored.hash) && stored == sig;
+}
+
+} // namespace detail
+
+/**
+ * @brief Compute the signature of a seekable binary stream
+ *
+ * The stream position is restored afterwards.
+ *
+ * @param in Stream to sign
+ * @param mtime Modification time of the source, if known
+ * @return Signature
+ */
+inline source_signature make_signature(std::istream &in, const std::uint64_t mtime = 0) {
+    const std::size_t sample = 64 * 1024;
+    const auto pos = in.tellg();
+    in.seekg(0, std::ios::end);
+    source_signature sig;
+    sig.size = static_cast<std::uint64_t>(in.tellg());
+    sig.mtime = mtime;
+    sig.hash = detail::fnv1a(reinterpret_cast<const char *>(&sig.size), sizeof(sig.size));
+
+    std::string buf(static_cast<std::size_t>(std::min<std::uint64_t>(sig.size, sample)), '\0');
+    in.seekg(0);
+    in.read(&buf[0], static_cast<std::streamsize>(buf.size()));
+    sig.hash = detail::fnv1a(buf.data(), buf.size(), sig.hash);
+    if(sig.size > sample) {
+        in.seekg(static_cast<std::streamoff>(sig.size - sample));
+        in.read(&buf[0], static_cast<std::streamsize>(buf.size()));
+        sig.hash = detail::fnv1a(buf.data(), buf.size(), sig.hash);
+    }
+
+    in.clear();
+    in.seekg(pos);
+    return sig;
+}
+
+struct table;
+
+/**
+ * @brief Decoded values of one column stored back to back
+ */
+class column {
+public:
+    /**
+     * @return Number of values
+     */
+    std::size_t size() const {
+        return _ends.size();
+    }
+
+    /**
+     * @param i Row index
+     * @return Value of row i
+     */
+    std::string operator[](const std::size_t i) const {
+        return std::string(data(i), length(i));
+    }
+
+    /**
+     * @param i Row index
+     * @return Pointer to the value of row i (not null terminated)
+     */
+    const char *data(const std::size_t i) const {
+        return _data.data() + (i == 0 ? 0 : _ends[i - 1]);
+    }
+
+    /**
+     * @param i Row index
+     * @return Length of the value of row i
+     */
+    std::size_t length(const std::size_t i) const {
+        return static_cast<std::size_t>(_ends[i] - (i == 0 ? 0 : _ends[i - 1]));
+    }
+
+    /**
+     * @brief Append a value
+     * @pre InIter must satisfy InputIterator
+     */
+    template <class InIter>
+    void push_back(InIter first, InIter last) {
+        _data.append(first, last);
+        _ends.push_back(_data.size());
+    }
+
+private:
+    friend void save_table(std::ostream &, const table &, const source_signature &);
+    friend bool load_table(std::istream &, const source_signature &, table &);
+
+    std::vector<std::uint64_t> _ends;
+    std::string _data;
+};
+
+/**
+ * @brief Decoded CSV data in columnar form
+ */
+struct table {
+    std::vector<std::string> header;
+    // Offset of each data record in the source
+    std::vector<std::uint64_t> offsets;
+    std::vector<column> columns;
+
+    /**
+     * @return Number of data records
+     */
+    std::size_t rows() const {
+        return offsets.size();
+    }
+};
+
+namespace detail {
+
+/**
+ * @brief Error for split fields that don't match the header
+ *
+ * The reader checks field counts before the record is split, so this
+ * only guards the column arrays in case the two ever disagree.
+ */
+template <class Iter>
+csv_error field_count_error(const reader &r, const std::vector<lazy_field<Iter>> &fields) {
+    return csv_error("Record has a different number of fields than the header",
+                     r.record_number() - 1, npos, r.record_offset(),
+                     excerpt(fields.front().begin(), fields.front().begin(), fields.back().end()));
+}
+
+} // namespace detail
+
+/**
+ * @brief Parse a whole CSV stream into a table
+ *
+ * The first record is the header.
+ *
+ * @param in Stream to read from
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Table
+ * @throws csv_error If a record is invalid (see parse_line())
+ * @throws csv_error If a record has a different number of fields than the header
+ */
+inline table build_table(std::istream &in, const char sep = ',', const mode pmode = mode::strict) {
+    table t;
+    reader r(in, sep, pmode, column_check::enforce);
+    if(!r.read_row(std::back_inserter(t.header))) {
+        return t;
+    }
+
+    t.columns.resize(t.header.size());
+    std::vector<lazy_field<std::string::const_iterator>> fields;
+    while(r.read_fields(std::back_inserter(fields))) {
+        if(fields.size() != t.columns.size()) {
+            throw detail::field_count_error(r, fields);
+        }
+        t.offsets.push_back(r.record_offset());
+        for(std::size_t i = 0; i < fields.size(); ++i) {
+            if(fields[i].escaped()) {
+                const auto value = fields[i].str();
+                t.columns[i].push_back(value.cbegin(), value.cend());
+            }
+            else {
+                t.columns[i].push_back(fields[i].begin(), fields[i].end());
+            }
+        }
+        fields.clear();
+    }
+
+    return t;
+}
+
+/**
+ * @brief Binary sidecar format version
+ *
+ * Bump whenever the layout written by save_table() changes.
+ */
+const std::uint32_t sidecar_version = 1;
+
+/**
+ * @brief Write a table into a binary sidecar
+ *
+ * The sidecar uses native byte order and is meant as a local cache.
+ *
+ * @param out Binary stream to write to
+ * @param t Table to write
+ * @param sig Signature of the source the table was built from
+ */
+inline void save_table(std::ostream &out, const table &t, const source_signature &sig) {
+    detail::write_sidecar_header(out, "SFCB", sidecar_version, sig);
+    detail::write_pod(out, static_cast<std::uint64_t>(t.rows()));
+    detail::write_pod(out, static_cast<std::uint64_t>(t.header.size()));
+    for(const auto &name : t.header) {
+        detail::write_string(out, name);
+    }
+
+    detail::write_pods(out, t.offsets);
+    for(const auto &col : t.columns) {
+        detail::write_pods(out, col._ends);
+        detail::write_pod(out, static_cast<std::uint64_t>(col._data.size()));
+        out.write(col._data.data(), static_cast<std::streamsize>(col._data.size()));
+    }
+}
+
+/**
+ * @brief Read a table from a binary sidecar
+ * @param in Binary stream to read from
+ * @param sig Signature of the current source
+ * @param t Table to fill
+ * @return False if the sidecar is stale, truncated, corrupt or in another format
+ */
+inline bool load_table(std::istream &in, const source_signature &sig, table &t) {
+    std::uint64_t rows = 0;
+    std::uint64_t cols = 0;
+    if(!detail::read_sidecar_header(in, "SFCB", sidecar_version, sig)
+            || !detail::read_pod(in, rows) || !detail::read_pod(in, cols)) {
+        return false;
+    }
+
+    table result;
+    for(std::uint64_t i = 0; i < cols; ++i) {
+        std::string name;
+        if(!detail::read_string(in, name)) {
+            return false;
+        }
+        result.header.push_back(std::move(name));
+    }
+
+    if(!detail::read_pods(in, result.offsets, rows)) {
+        return false;
+    }
+
+    result.columns.resize(static_cast<std::size_t>(cols));
+    for(auto &col : result.columns) {
+        std::uint64_t len = 0;
+        if(!detail::read_pods(in, col._ends, rows) || !detail::read_pod(in, len)
+                || !std::is_sorted(col._ends.cbegin(), col._ends.cend())
+                || (rows > 0 && col._ends.back() > len)
+                || !detail::read_values(in, col._data, len)) {
+            return false;
+        }
+    }
+
+    t = std::move(result);
+    return true;
+}
+
+/**
+ * @brief Load a CSV file through its binary sidecar
+ *
+ * Reads path + ".sfcb" if it matches the source, otherwise parses
+ * the source and writes a new sidecar. The sidecar is written to a
+ * temporary file first and renamed, so processes that load the same
+ * source at once never read a partly written sidecar.
+ *
+ * The signature only hashes the start and end of the source, so the
+ * modification time is required to notice edits in the middle.
+ *
+ * @param path Path of the CSV file
+ * @param mtime Modification time of the source, e.g. st_mtime from stat()
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Table
+ * @throws csv_error If the source cannot be opened
+ * @throws csv_error If the source is invalid (see build_table())
+ */
+inline table load_cached(const std::string &path, const std::uint64_t mtime,
+                         const char sep = ',', const mode pmode = mode::strict) {
+    std::ifstream src(path, std::ios::binary);
+    if(!src) {
+        throw csv_error("Cannot open source file");
+    }
+
+    const auto sig = make_signature(src, mtime);
+    const auto sidecar_path = path + ".sfcb";
+    table t;
+    {
+        std::ifstream sidecar(sidecar_path, std::ios::binary);
+        if(sidecar && load_table(sidecar, sig, t)) {
+            return t;
+        }
+    }
+
+    t = build_table(src, sep, pmode);
+    const auto tmp_path = sidecar_path + ".tmp" + std::to_string(std::random_device()());
+    {
+        std::ofstream sidecar(tmp_path, std::ios::binary | std::ios::trunc);
+        if(!sidecar) {
+            return t;
+        }
+        save_table(sidecar, t, sig);
+        sidecar.close();
+        if(!sidecar) {
+            std::remove(tmp_path.c_str());
+            return t;
+        }
+    }
+
+    // Replaces the old sidecar atomically where rename() does (POSIX)
+    if(std::rename(tmp_path.c_str(), sidecar_path.c_str()) != 0) {
+        std::remove(sidecar_path.c_str());
+        if(std::rename(tmp_path.c_str(), sidecar_path.c_str()) != 0) {
+            std::remove(tmp_path.c_str());
+        }
+    }
+
+    return t;
+}
+
+/**
+ * @brief Columnar table format version
+ *
+ * Bump whenever the layout written by write_columnar() changes.
+ */
+const std::uint32_t columnar_version = 1;
+
+namespace detail {
+
+// Directory entry of a column in the columnar format, all offsets from the start
+struct columnar_entry {
+    std::uint64_t name_offset;
+    std::uint64_t name_length;
+    std::uint64_t offsets_offset;
+    std::uint64_t validity_offset;
+    std::uint64_t data_offset;
+    std::uint64_t data_length;
+};
+
+inline std::uint64_t align8(const std::uint64_t n) {
+    return (n + 7) & ~std::uint64_t(7);
+}
+
+inline void write_padding(std::ostream &out, const std::uint64_t n) {
+    const char zeros[8] = {};
+    out.write(zeros, static_cast<std::streamsize>(align8(n) - n));
+}
+
+} // namespace detail
+
+/**
+ * @brief Convert a CSV stream into the columnar table format
+ *
+ * Each column is stored as an array of rows + 1 value offsets, a validity
+ * bitmap and the values back to back. Every section is 8-byte aligned, so
+ * a memory-mapped file can be used directly with columnar_view.
+ *
+ * Empty non-quoted fields are stored as null, "" as an empty string.
+ * The first record is the header.
+ *
+ * @param in Stream to read from
+ * @param out Binary stream to write to
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @throws csv_error If a record is invalid (see parse_line())
+ * @throws csv_error If a record has a different number of fields than the header
+ */
+inline void write_columnar(std::istream &in, std::ostream &out,
+                           const char sep = ',', const mode pmode = mode::strict) {
+    struct builder {
+        std::vector<std::uint64_t> offsets {0};
+        std::vector<std::uint64_t> validity;
+        std::string data;
+    };
+
+    reader r(in, sep, pmode, column_check::enforce);
+    std::vector<std::string> header;
+    r.read_row(std::back_inserter(header));
+
+    std::vector<builder> cols(header.size());
+    std::uint64_t rows = 0;
+    std::vector<lazy_field<std::string::const_iterator>> fields;
+    while(r.read_fields(std::back_inserter(fields))) {
+        if(fields.size() != cols.size()) {
+            throw detail::field_count_error(r, fields);
+        }
+        for(std::size_t i = 0; i < fields.size(); ++i) {
+            auto &col = cols[i];
+            const auto &f = fields[i];
+            if(rows % 64 == 0) {
+                col.validity.push_back(0);
+            }
+            if(f.escaped()) {
+                col.data += f.str();
+            }
+            else {
+                col.data.append(f.begin(), f.end());
+            }
+            if(f.quoted() || f.begin() != f.end()) {
+                col.validity.back() |= std::uint64_t(1) << (rows % 64);
+            }
+            col.offsets.push_back(col.data.size());
+        }
+        fields.clear();
+        ++rows;
+    }
+
+    // Lay out the sections after the fixed header and the column directory
+    std::vector<detail::columnar_entry> dir(cols.size());
+    std::uint64_t pos = 32 + cols.size() * sizeof(detail::columnar_entry);
+    for(std::size_t i = 0; i < cols.size(); ++i) {
+        dir[i].name_offset = pos;
+        dir[i].name_length = header[i].size();
+        pos = detail::align8(pos + dir[i].name_length);
+        dir[i].offsets_offset = pos;
+        pos += cols[i].offsets.size() * sizeof(std::uint64_t);
+        dir[i].validity_offset = pos;
+        pos += cols[i].validity.size() * sizeof(std::uint64_t);
+        dir[i].data_offset = pos;
+        dir[i].data_length = cols[i].data.size();
+        pos = detail::align8(pos + dir[i].data_length);
+    }
+
+    const std::uint32_t byte_order = 0x01020304;
+    const std::uint32_t reserved = 0;
+    out.write("SFCT", 4);
+    detail::write_pod(out, columnar_version);
+    detail::write_pod(out, byte_order);
+    detail::write_pod(out, reserved);
+    detail::write_pod(out, rows);
+    detail::write_pod(out, static_cast<std::uint64_t>(cols.size()));
+    detail::write_pods(out, dir);
+    for(std::size_t i = 0; i < cols.size(); ++i) {
+        out.write(header[i].data(), static_cast<std::streamsize>(header[i].size()));
+        detail::write_padding(out, header[i].size());
+        detail::write_pods(out, cols[i].offsets);
+        detail::write_pods(out, cols[i].validity);
+        out.write(cols[i].data.data(), static_cast<std::streamsize>(cols[i].data.size()));
+        detail::write_padding(out, cols[i].data.size());
+    }
+}
+
+/**
+ * @brief Column of a columnar_view
+ *
+ * Refers directly to the underlying buffer.
+ */
+class column_view {
+public:
+    column_view(const char *name, const std::size_t name_length, const std::uint64_t *offsets,
+                const std::uint64_t *validity, const char *data, const std::size_t rows)
+        : _name(name), _name_length(name_length), _offsets(offsets),
+          _validity(validity), _data(data), _rows(rows) {}
+
+    /**
+     * @return Column name from the header
+     */
+    std::string name() const {
+        return std::string(_name, _name_length);
+    }
+
+    /**
+     * @return Number of values
+     */
+    std::size_t size() const {
+        return _rows;
+    }
+
+    /**
+     * @param i Row index
+     * @return True if row i was an empty non-quoted field
+     */
+    bool is_null(const std::size_t i) const {
+        return (_validity[i / 64] & (std::uint64_t(1) << (i % 64))) == 0;
+    }
+
+    /**
+     * @param i Row index
+     * @return Pointer to the value of row i (not null terminated)
+     */
+    const char *data(const std::size_t i) const {
+        return _data + _offsets[i];
+    }
+
+    /**
+     * @param i Row index
+     * @return Length of the value of row i
+     */
+    std::size_t length(const std::size_t i) const {
+        return static_cast<std::size_t>(_offsets[i + 1] - _offsets[i]);
+    }
+
+    /**
+     * @param i Row index
+     * @return Value of row i
+     */
+    std::string operator[](const std::size_t i) const {
+        return std::string(data(i), length(i));
+    }
+
+private:
+    const char *_name;
+    std::size_t _name_length;
+    const std::uint64_t *_offsets;
+    const std::uint64_t *_validity;
+    const char *_data;
+    std::size_t _rows;
+};
+
+/**
+ * @brief Read-only view of a table in the columnar format
+ *
+ * Nothing is copied or deserialized, so the buffer is typically a
+ * memory-mapped file and only the pages of accessed columns are read.
+ * The buffer must outlive the view.
+ */
+class columnar_view {
+public:
+    /**
+     * @param data 8-byte aligned buffer written by write_columnar()
+     * @param size Buffer size
+     * @throws csv_error If the buffer is not a valid columnar table
+     */
+    columnar_view(const void *data, const std::size_t size)
+        : _base(static_cast<const char *>(data)), _size(size) {
+        std::uint32_t version = 0;
+        std::uint32_t byte_order = 0;
+        if(reinterpret_cast<std::uintptr_t>(_base) % 8 != 0 || _size < 32
+                || !std::equal(_base, _base + 4, "SFCT")) {
+            throw csv_error("Invalid columnar table");
+        }
+
+        std::memcpy(&version, _base + 4, sizeof(version));
+        std::memcpy(&byte_order, _base + 8, sizeof(byte_order));
+        std::memcpy(&_rows, _base + 16, sizeof(_rows));
+        std::memcpy(&_cols, _base + 24, sizeof(_cols));
+        if(version != columnar_version || byte_order != 0x01020304
+                || _cols > (_size - 32) / sizeof(detail::columnar_entry)
+                || _rows >= _size / 8) {
+            throw csv_error("Invalid columnar table");
+        }
+
+        const auto words = (_rows + 63) / 64;
+        for(std::size_t i = 0; i < _cols; ++i) {
+            const auto e = entry(i);
+            if(!fits(e.name_offset, e.name_length)
+                    || e.offsets_offset % 8 != 0 || e.validity_offset % 8 != 0
+                    || !fits(e.offsets_offset, (_rows + 1) * 8)
+                    || !fits(e.validity_offset, words * 8)
+                    || !fits(e.data_offset, e.data_length)) {
+                throw csv_error("Invalid columnar table");
+            }
+
+            // Values must lie within the data block in order
+            const auto begin = offsets(e);
+            if(!std::is_sorted(begin, begin + _rows + 1) || begin[_rows] != e.data_length) {
+                throw csv_error("Invalid columnar table");
+            }
+        }
+    }
+
+    /**
+     * @return Number of data records
+     */
+    std::size_t rows() const {
+        return static_cast<std::size_t>(_rows);
+    }
+
+    /**
+     * @return Number of columns
+     */
+    std::size_t columns() const {
+        return static_cast<std::size_t>(_cols);
+    }
+
+    /**
+     * @param i Column index
+     * @return View of column i
+     */
+    column_view column(const std::size_t i) const {
+        const auto e = entry(i);
+        return column_view(_base + e.name_offset, static_cast<std::size_t>(e.name_length),
+                           offsets(e),
+                           reinterpret_cast<const std::uint64_t *>(_base + e.validity_offset),
+                           _base + e.data_offset, rows());
+    }
+
+private:
+    // Written without overflow, offset and length come from the buffer
+    bool fits(const std::uint64_t offset, const std::uint64_t length) const {
+        return offset <= _size && length <= _size - offset;
+    }
+
+    detail::columnar_entry entry(const std::size_t i) const {
+        detail::columnar_entry e;
+        std::memcpy(&e, _base + 32 + i * sizeof(e), sizeof(e));
+        return e;
+    }
+
+    const std::uint64_t *offsets(const detail::columnar_entry &e) const {
+        return reinterpret_cast<const std::uint64_t *>(_base + e.offsets_offset);
+    }
+
+    const char *_base;
+    std::size_t _size;
+    std::uint64_t _rows = 0;
+    std::uint64_t _cols = 0;
+};
+
+/**
+ * @brief How values of a column are compared in zone maps
+ */
+enum class zone_type {
+    number,
+    text
+};
+
+/**
+ * @brief Column to keep zone maps for
+ *
+ * Use zone_type::text for ISO 8601 timestamps, which sort lexically.
+ */
+struct zone_column {
+    std::size_t column;
+    zone_type type;
+};
+
+/**
+ * @brief Smallest and largest value of a column within a block
+ *
+ * Values that are not numbers are ignored in zone_type::number columns.
+ */
+struct zone {
+    bool empty = true;
+    std::string min;
+    std::string max;
+};
+
+struct block_index;
+
+/**
+ * @brief Bloom filter over the values of a column within a block
+ *
+ * Uses 10 bits and 7 hashes per value, about 1% false positives.
+ */
+class bloom_filter {
+public:
+    bloom_filter() = default;
+
+    /**
+     * @param hashes Hashes of all values, see hash()
+     */
+    explicit bloom_filter(const std::vector<std::uint64_t> &hashes)
+        : _bits((hashes.size() * 10 + 63) / 64 + 1) {
+        for(const auto h : hashes) {
+            for(unsigned i = 0; i < num_hashes; ++i) {
+                const auto bit = nth_bit(h, i);
+                _bits[bit / 64] |= std::uint64_t(1) << (bit % 64);
+            }
+        }
+    }
+
+    /**
+     * @return Hash of a value
+     */
+    static std::uint64_t hash(const std::string &value) {
+        return detail::fnv1a(value.data(), value.size());
+    }
+
+    /**
+     * @param value Value to look up
+     * @return False if the value is definitely not in the block
+     */
+    bool may_contain(const std::string &value) const {
+        if(_bits.empty()) {
+            return false;
+        }
+
+        const auto h = hash(value);
+        for(unsigned i = 0; i < num_hashes; ++i) {
+            const auto bit = nth_bit(h, i);
+            if((_bits[bit / 64] & (std::uint64_t(1) << (bit % 64))) == 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    friend void save_block_index(std::ostream &, const block_index &, const source_signature &);
+    friend bool load_block_index(std::istream &, const source_signature &, block_index &);
+
+    static const unsigned num_hashes = 7;
+
+    // Double hashing with both halves of the 64-bit hash
+    std::uint64_t nth_bit(const std::uint64_t h, const unsigned i) const {
+        const auto h1 = h & 0xffffffffu;
+        const auto h2 = (h >> 32) | 1;
+        return (h1 + i * h2) % (_bits.size() * 64);
+    }
+
+    std::vector<std::uint64_t> _bits;
+};
+
+/**
+ * @brief Consecutive data records summarized in a block_index
+ */
+struct block {
+    // Offset of the first record in the source
+    std::uint64_t offset = 0;
+    std::uint64_t first_row = 0;
+    std::uint64_t rows = 0;
+    // One zone per block_index::columns entry
+    std::vector<zone> zones;
+    // One filter per block_index::bloom_columns entry
+    std::vector<bloom_filter> blooms;
+};
+
+namespace detail {
+
+inline bool to_number(const std::string &s, double &value) {
+    char *end = nullptr;
+    value = std::strtod(s.c_str(), &end);
+    return !s.empty() && end == s.c_str() + s.size();
+}
+
+// Compare two values of a zone_type::number or zone_type::text column
+inline bool zone_less(const zone_type type, const std::string &a, const std::string &b) {
+    double x = 0;
+    double y = 0;
+    if(type == zone_type::number && to_number(a, x) && to_number(b, y)) {
+        return x < y;
+    }
+
+    return a < b;
+}
+
+} // namespace detail
+
+/**
+ * @brief Sidecar index that splits a CSV into blocks of records
+ */
+struct block_index {
+    std::vector<zone_column> columns;
+    std::vector<std::size_t> bloom_columns;
+    std::vector<block> blocks;
+
+    /**
+     * @brief Find the blocks that may contain values in [lo, hi]
+     *
+     * Blocks can only be skipped if the column has zone maps.
+     *
+     * @param column Column number
+     * @param lo Smallest wanted value
+     * @param hi Largest wanted value
+     * @return Indexes of candidate blocks
+     */
+    std::vector<std::size_t> find_range(const std::size_t column, const std::string &lo,
+                                        const std::string &hi) const {
+        const auto slot = std::find_if(columns.cbegin(), columns.cend(), [&](const auto &c){
+            return c.column == column;
+        });
+        std::vector<std::size_t> result;
+        for(std::size_t i = 0; i < blocks.size(); ++i) {
+            if(slot == columns.cend()) {
+                result.push_back(i);
+                continue;
+            }
+
+            const auto &z = blocks[i].zones[static_cast<std::size_t>(slot - columns.cbegin())];
+            if(!z.empty && !detail::zone_less(slot->type, hi, z.min)
+                    && !detail::zone_less(slot->type, z.max, lo)) {
+                result.push_back(i);
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * @brief Find the blocks that may contain a value
+     *
+     * Uses the Bloom filters of the column, or its zone maps if it has none.
+     *
+     * @param column Column number
+     * @param value Wanted value
+     * @return Indexes of candidate blocks
+     */
+    std::vector<std::size_t> find_equal(const std::size_t column, const std::string &value) const {
+        const auto slot = std::find(bloom_columns.cbegin(), bloom_columns.cend(), column);
+        if(slot == bloom_columns.cend()) {
+            return find_range(column, value, value);
+        }
+
+        const auto n = static_cast<std::size_t>(slot - bloom_columns.cbegin());
+        std::vector<std::size_t> result;
+        for(std::size_t i = 0; i < blocks.size(); ++i) {
+            if(blocks[i].blooms[n].may_contain(value)) {
+                result.push_back(i);
+            }
+        }
+
+        return result;
+    }
+};
+
+/**
+ * @brief Build a block index from a CSV stream
+ *
+ * The first record is the header and is not part of any block.
+ *
+ * @param in Stream to read from, positioned at the start of the source
+ * @param columns Columns to keep zone maps for
+ * @param bloom_columns Columns to keep Bloom filters for
+ * @param block_rows Number of data records per block
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Block index
+ * @throws csv_error If a record is invalid (see parse_line())
+ */
+inline block_index build_block_index(std::istream &in, const std::vector<zone_column> &columns,
+                                     const std::vector<std::size_t> &bloom_columns = {},
+                                     const std::size_t block_rows = 65536, const char sep = ',',
+                                     const mode pmode = mode::strict) {
+    block_index idx;
+    idx.columns = columns;
+    idx.bloom_columns = bloom_columns;
+    reader r(in, sep, pmode);
+    std::string header;
+    if(!r.read_record(header)) {
+        return idx;
+    }
+
+    // Value hashes of the current block, turned into filters once it is complete
+    std::vector<std::vector<std::uint64_t>> hashes(bloom_columns.size());
+    const auto finish_block = [&]() {
+        if(!idx.blocks.empty()) {
+            for(auto &h : hashes) {
+                idx.blocks.back().blooms.emplace_back(h);
+                h.clear();
+            }
+        }
+    };
+
+    std::uint64_t row = 0;
+    std::vector<lazy_field<std::string::const_iterator>> fields;
+    while(r.read_fields(std::back_inserter(fields))) {
+        if(row % block_rows == 0) {
+            finish_block();
+            idx.blocks.emplace_back();
+            idx.blocks.back().offset = r.record_offset();
+            idx.blocks.back().first_row = row;
+            idx.blocks.back().zones.resize(columns.size());
+        }
+
+        auto &b = idx.blocks.back();
+        for(std::size_t i = 0; i < bloom_columns.size(); ++i) {
+            if(bloom_columns[i] < fields.size()) {
+                hashes[i].push_back(bloom_filter::hash(fields[bloom_columns[i]].str()));
+            }
+        }
+
+        for(std::size_t i = 0; i < columns.size(); ++i) {
+            if(columns[i].column >= fields.size()) {
+                continue;
+            }
+
+            const auto value = fields[columns[i].column].str();
+            double number = 0;
+            if(columns[i].type == zone_type::number && !detail::to_number(value, number)) {
+                continue;
+            }
+
+            auto &z = b.zones[i];
+            if(z.empty) {
+                z.empty = false;
+                z.min = z.max = value;
+            }
+            else if(detail::zone_less(columns[i].type, value, z.min)) {
+                z.min = value;
+            }
+            else if(detail::zone_less(columns[i].type, z.max, value)) {
+                z.max = value;
+            }
+        }
+
+        ++b.rows;
+        ++row;
+        fields.clear();
+    }
+
+    finish_block();
+    return idx;
+}
+
+/**
+ * @brief Block index sidecar format version
+ *
+ * Bump whenever the layout written by save_block_index() changes.
+ */
+const std::uint32_t block_index_version = 2;
+
+/**
+ * @brief Write a block index into a binary sidecar
+ * @param out Binary stream to write to
+ * @param idx Block index to write
+ * @param sig Signature of the source the index was built from
+ */
+inline void save_block_index(std::ostream &out, const block_index &idx,
+                             const source_signature &sig) {
+    detail::write_sidecar_header(out, "SFCI", block_index_version, sig);
+    detail::write_pod(out, static_cast<std::uint64_t>(idx.columns.size()));
+    for(const auto &c : idx.columns) {
+        detail::write_pod(out, static_cast<std::uint64_t>(c.column));
+        detail::write_pod(out, static_cast<std::uint8_t>(c.type));
+    }
+
+    detail::write_pod(out, static_cast<std::uint64_t>(idx.bloom_columns.size()));
+    for(const auto c : idx.bloom_columns) {
+        detail::write_pod(out, static_cast<std::uint64_t>(c));
+    }
+
+    detail::write_pod(out, static_cast<std::uint64_t>(idx.blocks.size()));
+    for(const auto &b : idx.blocks) {
+        detail::write_pod(out, b.offset);
+        detail::write_pod(out, b.first_row);
+        detail::write_pod(out, b.rows);
+        for(const auto &z : b.zones) {
+            detail::write_pod(out, static_cast<std::uint8_t>(z.empty));
+            detail::write_string(out, z.min);
+            detail::write_string(out, z.max);
+        }
+        for(const auto &f : b.blooms) {
+            detail::write_pod(out, static_cast<std::uint64_t>(f._bits.size()));
+            detail::write_pods(out, f._bits);
+        }
+    }
+}
+
+/**
+ * @brief Read a block index from a binary sidecar
+ * @param in Binary stream to read from
+ * @param sig Signature of the current source
+ * @param idx Block index to fill
+ * @return False if the sidecar is stale, truncated, corrupt or in another format
+ */
+inline bool load_block_index(std::istream &in, const source_signature &sig, block_index &idx) {
+    std::uint64_t count = 0;
+    if(!detail::read_sidecar_header(in, "SFCI", block_index_version, sig)
+            || !detail::read_pod(in, count)) {
+        return false;
+    }
+
+    block_index result;
+    for(std::uint64_t i = 0; i < count; ++i) {
+        std::uint64_t column = 0;
+        std::uint8_t type = 0;
+        if(!detail::read_pod(in, column) || !detail::read_pod(in, type)
+                || type > static_cast<std::uint8_t>(zone_type::text)) {
+            return false;
+        }
+        result.columns.push_back({static_cast<std::size_t>(column), static_cast<zone_type>(type)});
+    }
+
+    if(!detail::read_pod(in, count)) {
+        return false;
+    }
+
+    for(std::uint64_t i = 0; i < count; ++i) {
+        std::uint64_t column = 0;
+        if(!detail::read_pod(in, column)) {
+            return false;
+        }
+        result.bloom_columns.push_back(static_cast<std::size_t>(column));
+    }
+
+    if(!detail::read_pod(in, count)) {
+        return false;
+    }
+
+    for(std::uint64_t i = 0; i < count; ++i) {
+        result.blocks.emplace_back();
+        auto &b = result.blocks.back();
+        if(!detail::read_pod(in, b.offset) || !detail::read_pod(in, b.first_row)
+                || !detail::read_pod(in, b.rows)) {
+            return false;
+        }
+        b.zones.resize(result.columns.size());
+        for(auto &z : b.zones) {
+            std::uint8_t empty = 0;
+            if(!detail::read_pod(in, empty) || !detail::read_string(in, z.min)
+                    || !detail::read_string(in, z.max)) {
+                return false;
+            }
+            z.empty = empty != 0;
+        }
+        b.blooms.resize(result.bloom_columns.size());
+        for(auto &f : b.blooms) {
+            std::uint64_t words = 0;
+            if(!detail::read_pod(in, words) || !detail::read_pods(in, f._bits, words)) {
+                return false;
+            }
+        }
+    }
+
+    idx = std::move(result);
+    return true;
+}
+
+/**
+ * @brief Parse only the records of one block
+ * @pre Fn must be callable with const std::vector<std::string>&
+ * @param in Seekable stream of the source the index was built from
+ * @param b Block to read
+ * @param fn Called with the fields of every record in the block
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @throws csv_error If a record is invalid (see parse_line())
+ */
+template <class Fn>
+void for_each_row(std::istream &in, const block &b, Fn fn,
+                  const char sep = ',', const mode pmode = mode::strict) {
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(b.offset));
+    reader r(in, sep, pmode);
+    std::vector<std::string> row;
+    for(std::uint64_t i = 0; i < b.rows && r.read_row(std::back_inserter(row)); ++i) {
+        fn(static_cast<const std::vector<std::string> &>(row));
+        row.clear();
+    }
+}
+
+/**
+ * @brief Sidecar index from the values of a key column to record offsets
+ */
+struct key_index {
+    std::size_t column = 0;
+    // Sorted by key, duplicate keys are kept
+    std::vector<std::pair<std::string, std::uint64_t>> entries;
+
+    /**
+     * @param key Key to look up
+     * @return Offsets of the records with the key
+     */
+    std::vector<std::uint64_t> find(const std::string &key) const {
+        const auto range = std::equal_range(entries.cbegin(), entries.cend(),
+                                            std::make_pair(key, std::uint64_t(0)),
+                                            [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
+        std::vector<std::uint64_t> result;
+        for(auto it = range.first; it != range.second; ++it) {
+            result.push_back(it->second);
+        }
+
+        return result;
+    }
+};
+
+/**
+ * @brief Build a key index from a CSV stream
+ *
+ * The first record is the header and is not indexed.
+ *
+ * @param in Stream to read from, positioned at the start of the source
+ * @param column Key column number
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Key index
+ * @throws csv_error If a record is invalid (see parse_line())
+ * @throws csv_error If a record has no key column
+ */
+inline key_index build_key_index(std::istream &in, const std::size_t column,
+                                 const char sep = ',', const mode pmode = mode::strict) {
+    key_index idx;
+    idx.column = column;
+    reader r(in, sep, pmode);
+    std::string header;
+    if(!r.read_record(header)) {
+        return idx;
+    }
+
+    std::vector<lazy_field<std::string::const_iterator>> fields;
+    while(r.read_fields(std::back_inserter(fields))) {
+        if(column >= fields.size()) {
+            // Quoted fields exclude their quotes
+            const auto first = fields.front().begin() - (fields.front().quoted() ? 1 : 0);
+            const auto last = fields.back().end() + (fields.back().quoted() ? 1 : 0);
+            throw csv_error("Record has no key column", r.record_number() - 1, npos,
+                            r.record_offset(), detail::excerpt(first, first, last));
+        }
+        idx.entries.emplace_back(fields[column].str(), r.record_offset());
+        fields.clear();
+    }
+
+    std::stable_sort(idx.entries.begin(), idx.entries.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+    return idx;
+}
+
+/**
+ * @brief Key index sidecar format version
+ *
+ * Bump whenever the layout written by save_key_index() changes.
+ */
+const std::uint32_t key_index_version = 1;
+
+/**
+ * @brief Write a key index into a binary sidecar
+ * @param out Binary stream to write to
+ * @param idx Key index to write
+ * @param sig Signature of the source the index was built from
+ */
+inline void save_key_index(std::ostream &out, const key_index &idx, const source_signature &sig) {
+    detail::write_sidecar_header(out, "SFCK", key_index_version, sig);
+    detail::write_pod(out, static_cast<std::uint64_t>(idx.column));
+    detail::write_pod(out, static_cast<std::uint64_t>(idx.entries.size()));
+    for(const auto &e : idx.entries) {
+        detail::write_string(out, e.first);
+        detail::write_pod(out, e.second);
+    }
+}
+
+/**
+ * @brief Read a key index from a binary sidecar
+ * @param in Binary stream to read from
+ * @param sig Signature of the current source
+ * @param idx Key index to fill
+ * @return False if the sidecar is stale, truncated, corrupt or in another format
+ */
+inline bool load_key_index(std::istream &in, const source_signature &sig, key_index &idx) {
+    std::uint64_t column = 0;
+    std::uint64_t count = 0;
+    if(!detail::read_sidecar_header(in, "SFCK", key_index_version, sig)
+            || !detail::read_pod(in, column) || !detail::read_pod(in, count)) {
+        return false;
+    }
+
+    key_index result;
+    result.column = static_cast<std::size_t>(column);
+    for(std::uint64_t i = 0; i < count; ++i) {
+        std::pair<std::string, std::uint64_t> e;
+        if(!detail::read_string(in, e.first) || !detail::read_pod(in, e.second)) {
+            return false;
+        }
+        result.entries.push_back(std::move(e));
+    }
+
+    // find() relies on the entries being sorted by key
+    if(!std::is_sorted(result.entries.cbegin(), result.entries.cend(),
+                       [](const auto &a, const auto &b) { return a.first < b.first; })) {
+        return false;
+    }
+
+    idx = std::move(result);
+    return true;
+}
+
+/**
+ * @brief Parse the record at an offset
+ * @pre OutIter must satisfy OutputIterator
+ * @param in Seekable stream of the source
+ * @param offset Offset of the record, e.g. from key_index::find()
+ * @param out Output iterator
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return False if there is no record at the offset
+ * @throws csv_error If the record is invalid (see parse_line())
+ */
+template <class OutIter>
+bool read_row_at(std::istream &in, const std::uint64_t offset, OutIter out,
+                 const char sep = ',', const mode pmode = mode::strict) {
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(offset));
+    reader r(in, sep, pmode);
+    return r.read_row(out);
+}
+
+/**
+ * @brief Sparse sidecar index of row offsets for access by row number
+ *
+ * Keeps the offset of every stride-th row, so a row is reached by seeking
+ * to the nearest entry before it and skipping fewer than stride records.
+ */
+struct row_index {
+    std::uint64_t stride = 0;
+    std::uint64_t rows = 0;               // without the header
+    std::vector<std::uint64_t> offsets;   // offsets[i] is the offset of row i * stride
+};
+
+/**
+ * @brief Build a row index in one pass that only counts records
+ *
+ * Records are found by their unquoted newlines and nothing is parsed.
+ * Quotes are followed by the rules of pmode, so the rows match the
+ * records read_rows() skips with the same mode.
+ *
+ * @param in Stream to read from, positioned at the start of the source
+ * @param stride Number of rows per index entry
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @param cancel Cancellation checked for every block read, or nullptr
+ * @return Row index
+ * @throws cancelled_error If cancelled
+ */
+inline row_index build_row_index(std::istream &in, const std::uint64_t stride = 1024,
+                                 const char sep = ',', const mode pmode = mode::strict,
+                                 const cancellation *cancel = nullptr) {
+    row_index idx;
+    idx.stride = std::max<std::uint64_t>(stride, 1);
+
+    std::vector<char> buf(1 << 20);
+    auto offset = static_cast<std::uint64_t>(in.tellg());
+    std::uint64_t records = 0;
+    bool in_quotes = false;
+    detail::quote_scanner<char> quotes(sep, pmode);
+    bool record_start = true;
+    while(in.read(buf.data(), static_cast<std::streamsize>(buf.size())) || in.gcount() > 0) {
+        if(cancel != nullptr) {
+            cancel->check();
+        }
+
+        const char *first = buf.data();
+        const auto last = first + in.gcount();
+        for(auto it = first; it != last; ) {
+            if(record_start) {
+                if(records != 0 && (records - 1) % idx.stride == 0) {
+                    idx.offsets.push_back(offset + static_cast<std::uint64_t>(it - first));
+                }
+                ++records;
+                record_start = false;
+            }
+
+            if(pmode == mode::strict) {
+                it = detail::scan_record_end(it, last, in_quotes);
+            }
+            else {
+                while(it != last && !(quotes.push(*it) && *it == '\n')) {
+                    ++it;
+                }
+            }
+            if(it != last) {
+                record_start = true;
+                ++it;
+            }
+        }
+        offset += static_cast<std::uint64_t>(last - first);
+    }
+
+    idx.rows = records == 0 ? 0 : records - 1;
+    return idx;
+}
+
+/**
+ * @brief Row index sidecar format version
+ *
+ * Bump whenever the layout written by save_row_index() changes.
+ */
+const std::uint32_t row_index_version = 1;
+
+/**
+ * @brief Write a row index into a binary sidecar
+ * @param out Binary stream to write to
+ * @param idx Row index to write
+ * @param sig Signature of the source the index was built from
+ */
+inline void save_row_index(std::ostream &out, const row_index &idx, const source_signature &sig) {
+    detail::write_sidecar_header(out, "SFCR", row_index_version, sig);
+    detail::write_pod(out, idx.stride);
+    detail::write_pod(out, idx.rows);
+    detail::write_pod(out, static_cast<std::uint64_t>(idx.offsets.size()));
+    detail::write_pods(out, idx.offsets);
+}
+
+/**
+ * @brief Read a row index from a binary sidecar
+ * @param in Binary stream to read from
+ * @param sig Signature of the current source
+ * @param idx Row index to fill
+ * @return False if the sidecar is stale, truncated, corrupt or in another format
+ */
+inline bool load_row_index(std::istream &in, const source_signature &sig, row_index &idx) {
+    row_index result;
+    std::uint64_t count = 0;
+    if(!detail::read_sidecar_header(in, "SFCR", row_index_version, sig)
+            || !detail::read_pod(in, result.stride) || !detail::read_pod(in, result.rows)
+            || !detail::read_pod(in, count) || !detail::read_pods(in, result.offsets, count)) {
+        return false;
+    }
+
+    // read_rows() looks up offsets[first_row / stride] for every row below rows
+    if(result.stride == 0
+            || count != result.rows / result.stride + (result.rows % result.stride != 0)
+            || !std::is_sorted(result.offsets.cbegin(), result.offsets.cend())) {
+        return false;
+    }
+
+    idx = std::move(result);
+    return true;
+}
+
+/**
+ * @brief Parse a range of rows by row number
+ * @param in Seekable stream of the source
+ * @param idx Row index of the source
+ * @param first_row Number of the first row, 0 is the row after the header
+ * @param count Number of rows
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Up to count rows, fewer at the end of the source
+ * @throws csv_error If one of the rows is invalid (see parse_line())
+ */
+inline std::vector<std::vector<std::string>> read_rows(std::istream &in, const row_index &idx,
+                                                       const std::uint64_t first_row,
+                                                       const std::size_t count,
+                                                       const char sep = ',',
+                                                       const mode pmode = mode::strict) {
+    std::vector<std::vector<std::string>> rows;
+    if(first_row >= idx.rows || count == 0) {
+        return rows;
+    }
+
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(idx.offsets[static_cast<std::size_t>(first_row / idx.stride)]));
+    reader r(in, sep, pmode);
+    std::string record;
+    for(auto skip = first_row % idx.stride; skip != 0 && r.read_record(record); --skip) {
+    }
+
+    while(rows.size() < count) {
+        rows.emplace_back();
+        if(!r.read_row(std::back_inserter(rows.back()))) {
+            rows.pop_back();
+            break;
+        }
+    }
+    return rows;
+}
+
+/**
+ * @brief Key lookups on a CSV source with a cache of recently used rows
+ *
+ * Keeps the parsed rows of up to capacity keys, evicting the least
+ * recently used key first. Meant for long-running services that
+ * answer many lookups on the same source.
+ */
+class lookup_table {
+public:
+    using rows_type = std::vector<std::vector<std::string>>;
+
+    /**
+     * @param in Seekable stream of the source, must outlive the table
+     * @param idx Key index of the source
+     * @param capacity Number of keys to cache
+     * @param sep Field separator
+     * @param pmode Parsing mode
+     */
+    lookup_table(std::istream &in, key_index idx, const std::size_t capacity = 1024,
+                 const char sep = ',', const mode pmode = mode::strict)
+        : _in(in), _idx(std::move(idx)), _capacity(capacity), _sep(sep), _mode(pmode) {}
+
+    /**
+     * @param key Key to look up
+     * @return Parsed records with the key, valid until the next call
+     * @throws csv_error If a record is invalid (see parse_line())
+     */
+    const rows_type &find(const std::string &key) {
+        const auto cached = _cache.find(key);
+        if(cached != _cache.end()) {
+            ++_hits;
+            _lru.splice(_lru.begin(), _lru, cached->second);
+            return cached->second->second;
+        }
+
+        ++_misses;
+        rows_type rows;
+        for(const auto offset : _idx.find(key)) {
+            rows.emplace_back();
+            read_row_at(_in, offset, std::back_inserter(rows.back()), _sep, _mode);
+        }
+
+        if(_capacity == 0) {
+            _uncached = std::move(rows);
+            return _uncached;
+        }
+
+        if(_cache.size() == _capacity) {
+            _cache.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+
+        _lru.emplace_front(key, std::move(rows));
+        _cache.emplace(key, _lru.begin());
+        return _lru.front().second;
+    }
+
+    /**
+     * @return Key index of the source
+     */
+    const key_index &index() const {
+        return _idx;
+    }
+
+    /**
+     * @return Number of lookups answered from the cache
+     */
+    std::size_t hits() const {
+        return _hits;
+    }
+
+    /**
+     * @return Number of lookups that had to parse the source
+     */
+    std::size_t misses() const {
+        return _misses;
+    }
+
+private:
+    using entry_list = std::list<std::pair<std::string, rows_type>>;
+
+    std::istream &_in;
+    key_index _idx;
+    const std::size_t _capacity;
+    const char _sep;
+    const mode _mode;
+    entry_list _lru;
+    std::unordered_map<std::string, entry_list::iterator> _cache;
+    rows_type _uncached;
+    std::size_t _hits = 0;
+    std::size_t _misses = 0;
+};
+
+namespace detail {
+
+// Finalizer of MurmurHash3, spreads the bits of a hash over the whole word
+inline std::uint64_t mix64(std::uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+} // namespace detail
+
+/**
+ * @brief Approximate distinct count in 4 KiB, about 1.6% standard error
+ *
+ * Sketches of parts of the input can be merged into the sketch of the whole.
+ */
+class hyperloglog {
+public:
+    hyperloglog() : _registers(std::size_t(1) << precision) {}
+
+    /**
+     * @return Hash of a value
+     */
+    static std::uint64_t hash(const char *data, const std::size_t size) {
+        return detail::mix64(detail::fnv1a(data, size));
+    }
+
+    /**
+     * @param h Hash of the value, see hash()
+     */
+    void add(const std::uint64_t h) {
+        auto &reg = _registers[h >> (64 - precision)];
+        auto rest = h << precision;
+        std::uint8_t rank = 1;
+        while(rank <= 64 - precision && (rest >> 63) == 0) {
+            rest <<= 1;
+            ++rank;
+        }
+        reg = std::max(reg, rank);
+    }
+
+    void merge(const hyperloglog &other) {
+        for(std::size_t i = 0; i < _registers.size(); ++i) {
+            _registers[i] = std::max(_registers[i], other._registers[i]);
+        }
+    }
+
+    /**
+     * @return Estimated number of distinct values added
+     */
+    std::uint64_t estimate() const {
+        const double m = static_cast<double>(_registers.size());
+        double sum = 0;
+        std::size_t zeros = 0;
+        for(const auto r : _registers) {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0 ? 1 : 0;
+        }
+
+        auto e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if(e <= 2.5 * m && zeros != 0) {
+            // Linear counting is more accurate for small cardinalities
+            e = m * std::log(m / static_cast<double>(zeros));
+        }
+        return static_cast<std::uint64_t>(e + 0.5);
+    }
+
+private:
+    static const unsigned precision = 12;
+
+    std::vector<std::uint8_t> _registers;
+};
+
+/**
+ * @brief Approximate frequencies in a fixed amount of memory
+ *
+ * Estimates never undercount, and overcount by at most about 0.3% of the
+ * total count. Sketches are merged by adding them, which is exact.
+ */
+class count_min_sketch {
+public:
+    count_min_sketch() : _counts(depth * width) {}
+
+    /**
+     * @param h Hash of the value, see hyperloglog::hash()
+     * @param n Count to add
+     */
+    void add(const std::uint64_t h, const std::uint64_t n = 1) {
+        for(unsigned i = 0; i < depth; ++i) {
+            _counts[cell(h, i)] += n;
+        }
+    }
+
+    /**
+     * @param h Hash of the value
+     * @return Estimated count of the value
+     */
+    std::uint64_t estimate(const std::uint64_t h) const {
+        auto est = std::numeric_limits<std::uint64_t>::max();
+        for(unsigned i = 0; i < depth; ++i) {
+            est = std::min(est, _counts[cell(h, i)]);
+        }
+        return est;
+    }
+
+    void merge(const count_min_sketch &other) {
+        for(std::size_t i = 0; i < _counts.size(); ++i) {
+            _counts[i] += other._counts[i];
+        }
+    }
+
+private:
+    static const unsigned depth = 4;
+    static const unsigned width = 1024;
+
+    // Rows use independent hashes, so values that collide in one row rarely collide in all
+    static std::size_t cell(const std::uint64_t h, const unsigned i) {
+        return i * width + static_cast<std::size_t>(
+            detail::mix64(h + i * 0x9e3779b97f4a7c15ULL) & (width - 1));
+    }
+
+    std::vector<std::uint64_t> _counts;
+};
+
+/**
+ * @brief Summary of the values of a column, see profile_columns()
+ *
+ * Distinct counts and top values are approximate, everything else is exact.
+ */
+struct column_profile {
+    std::string name;
+    std::uint64_t values = 0;    // non-null values
+    std::uint64_t nulls = 0;     // empty non-quoted fields
+    std::uint64_t distinct = 0;
+    bool numeric = false;        // all values are numbers
+    std::string min;             // compared as numbers if numeric
+    std::string max;
+    // Value lengths: [0] counts empty values, [i] lengths in [2^(i-1), 2^i),
+    // and the last bucket everything longer
+    std::array<std::uint64_t, 16> lengths{};
+    std::vector<std::pair<std::string, std::uint64_t>> top;  // most frequent first
+};
+
+namespace detail {
+
+/**
+ * @brief Mergeable state of one column while profiling
+ */
+class column_sketch {
+public:
+    explicit column_sketch(const std::size_t top_k) : _capacity(top_k * 4 + 16) {}
+
+    void add(const char *first, const char *last) {
+        const auto size = static_cast<std::size_t>(last - first);
+        const auto h = hyperloglog::hash(first, size);
+        _distinct.add(h);
+        _counts.add(h);
+        ++_values;
+
+        unsigned bucket = 0;
+        for(auto n = size; n != 0 && bucket + 1 < _lengths.size(); n >>= 1) {
+            ++bucket;
+        }
+        ++_lengths[bucket];
+
+        if(_values == 1 || _min.compare(0, _min.size(), first, size) > 0) {
+            _min.assign(first, size);
+        }
+        if(_values == 1 || _max.compare(0, _max.size(), first, size) < 0) {
+            _max.assign(first, size);
+        }
+
+        if(_numeric) {
+            _buf.assign(first, size);
+            double x = 0;
+            _numeric = to_number(_buf, x);
+            if(_numeric) {
+                add_number(x, _buf);
+            }
+        }
+
+        // Keep values that may be among the most frequent, pruning in batches
+        if(_candidates.count(h) == 0 && (_candidates.size() < _capacity
+                                         || _counts.estimate(h) > _threshold)) {
+            _candidates.emplace(h, std::string(first, size));
+            if(_candidates.size() >= 2 * _capacity) {
+                prune(_capacity);
+            }
+        }
+    }
+
+    void merge(column_sketch &other) {
+        _distinct.merge(other._distinct);
+        _counts.merge(other._counts);
+        for(std::size_t i = 0; i < _lengths.size(); ++i) {
+            _lengths[i] += other._lengths[i];
+        }
+
+        if(other._values != 0) {
+            if(_values == 0 || other._min < _min) {
+                _min = other._min;
+            }
+            if(_values == 0 || other._max > _max) {
+                _max = other._max;
+            }
+            if(other._numeric && other._num_min < _num_min) {
+                _num_min = other._num_min;
+                _num_min_text = other._num_min_text;
+            }
+            if(other._numeric && other._num_max > _num_max) {
+                _num_max = other._num_max;
+                _num_max_text = other._num_max_text;
+            }
+            _numeric = _numeric && other._numeric;
+        }
+        _values += other._values;
+
+        for(auto &c : other._candidates) {
+            _candidates.emplace(c.first, std::move(c.second));
+        }
+        prune(_capacity);
+    }
+
+    column_profile result(const std::size_t top_k) {
+        column_profile p;
+        p.values = _values;
+        p.distinct = std::min(_distinct.estimate(), _values);
+        p.numeric = _numeric && _values != 0;
+        p.min = p.numeric ? _num_min_text : _min;
+        p.max = p.numeric ? _num_max_text : _max;
+        p.lengths = _lengths;
+
+        prune(top_k);
+        for(const auto &c : _candidates) {
+            p.top.emplace_back(c.second, _counts.estimate(c.first));
+        }
+        std::sort(p.top.begin(), p.top.end(), [](const auto &a, const auto &b) {
+            return a.second > b.second || (a.second == b.second && a.first < b.first);
+        });
+        return p;
+    }
+
+private:
+    void add_number(const double x, const std::string &text) {
+        if(x < _num_min) {
+            _num_min = x;
+            _num_min_text = text;
+        }
+        if(x > _num_max) {
+            _num_max = x;
+            _num_max_text = text;
+        }
+    }
+
+    // Keep the n candidates with the highest estimates
+    void prune(const std::size_t n) {
+        if(_candidates.size() <= n) {
+            return;
+        }
+
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> est;
+        for(const auto &c : _candidates) {
+            est.emplace_back(_counts.estimate(c.first), c.first);
+        }
+        std::nth_element(est.begin(), est.begin() + static_cast<std::ptrdiff_t>(n), est.end(),
+                         std::greater<std::pair<std::uint64_t, std::uint64_t>>());
+        _threshold = est[n].first;
+        for(auto it = est.begin() + static_cast<std::ptrdiff_t>(n); it != est.end(); ++it) {
+            _candidates.erase(it->second);
+        }
+    }
+
+    std::size_t _capacity;
+    hyperloglog _distinct;
+    count_min_sketch _counts;
+    std::unordered_map<std::uint64_t, std::string> _candidates;
+    std::uint64_t _threshold = 0;
+    std::uint64_t _values = 0;
+    std::array<std::uint64_t, 16> _lengths{};
+    std::string _min;
+    std::string _max;
+    bool _numeric = true;
+    double _num_min = std::numeric_limits<double>::infinity();
+    double _num_max = -std::numeric_limits<double>::infinity();
+    std::string _num_min_text;
+    std::string _num_max_text;
+    std::string _buf;
+};
+
+} // namespace detail
+
+/**
+ * @brief Profile every column of a CSV in one parallel scan
+ *
+ * Works on the lazy fields of parallel_for_each_row(), so values are
+ * only copied when they are escaped or become a new minimum, maximum or
+ * frequent value candidate. Every thread keeps its own sketches, which
+ * are merged at the end. Fields past the header's columns are ignored.
+ *
+ * @param first Start of the buffer, beginning with the header
+ * @param last End of the buffer
+ * @param top_k Number of most frequent values to report per column
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @param threads Number of threads
+ * @param cancel Cancellation to check, or nullptr
+ * @return Profile of each column of the header
+ * @throws csv_error If the header is invalid
+ * @throws cancelled_error If cancelled
+ */
+inline std::vector<column_profile> profile_columns(const char *first, const char *last,
+                                                   const std::size_t top_k = 10,
+                                                   const char sep = ',',
+                                                   const mode pmode = mode::strict,
+                                                   const unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+                                                   const cancellation *cancel = nullptr) {
+    std::vector<std::string> header;
+    parse_line(std::string(first, find_record_end(first, last, sep, pmode)),
+               std::back_inserter(header), sep, pmode);
+
+    scan_counters counters(header.size(), threads);
+    std::vector<std::vector<detail::column_sketch>> sketches(
+        counters.threads(), std::vector<detail::column_sketch>(header.size(),
+                                                               detail::column_sketch(top_k)));
+    parallel_for_each_row(first, last, [&](const unsigned worker, const auto &fields) {
+        auto &columns = sketches[worker];
+        const auto n = std::min(fields.size(), columns.size());
+        for(std::size_t i = 0; i < n; ++i) {
+            const auto &f = fields[i];
+            if(f.escaped()) {
+                const auto value = f.str();
+                columns[i].add(value.data(), value.data() + value.size());
+            }
+            else if(f.begin() != f.end() || f.quoted()) {
+                columns[i].add(f.begin(), f.end());
+            }
+        }
+    }, counters, sep, pmode, cancel);
+
+    const auto stats = counters.snapshot();
+    std::vector<column_profile> profiles;
+    for(std::size_t i = 0; i < header.size(); ++i) {
+        for(std::size_t w = 1; w < sketches.size(); ++w) {
+            sketches[0][i].merge(sketches[w][i]);
+        }
+        profiles.push_back(sketches[0][i].result(top_k));
+        profiles.back().name = header[i];
+        profiles.back().nulls = stats.nulls[i];
+    }
+    return profiles;
+}
+
+namespace detail {
+
+using record_range = std::pair<const char *, const char *>;
+
+/**
+ * @brief Uniform sample of k records of one chunk (Algorithm L)
+ *
+ * After the reservoir is full, the number of records to skip until the
+ * next replacement is drawn directly, so most records cost no random numbers.
+ */
+class reservoir {
+public:
+    reservoir(const std::size_t k, const std::uint64_t seed) : _k(k), _rng(seed) {
+        next_weight();
+    }
+
+    void add(const char *first, const char *last) {
+        ++_seen;
+        if(_sample.size() < _k) {
+            _sample.emplace_back(first, last);
+            if(_sample.size() == _k) {
+                next_skip();
+            }
+        }
+        else if(_seen == _next) {
+            _sample[std::uniform_int_distribution<std::size_t>(0, _k - 1)(_rng)] = {first, last};
+            next_weight();
+            next_skip();
+        }
+    }
+
+    std::uint64_t seen() const {
+        return _seen;
+    }
+
+    std::vector<record_range> &sample() {
+        return _sample;
+    }
+
+private:
+    double uniform() {
+        return std::uniform_real_distribution<double>(std::numeric_limits<double>::min(), 1.0)(_rng);
+    }
+
+    void next_weight() {
+        _w *= std::exp(std::log(uniform()) / static_cast<double>(std::max<std::size_t>(_k, 1)));
+    }
+
+    void next_skip() {
+        const auto skip = std::floor(std::log(uniform()) / std::log1p(-_w));
+        _next = skip < 1e18 ? _seen + static_cast<std::uint64_t>(skip) + 1
+                            : std::numeric_limits<std::uint64_t>::max();
+    }
+
+    const std::size_t _k;
+    std::mt19937_64 _rng;
+    std::vector<record_range> _sample;
+    std::uint64_t _seen = 0;
+    std::uint64_t _next = 0;
+    double _w = 1;
+};
+
+} // namespace detail
+
+/**
+ * @brief Draw a uniform random sample of records in one parallel pass
+ *
+ * Every thread keeps a reservoir of its own records. The reservoirs are
+ * merged by drawing, for each sampled record, which thread it comes from
+ * with probability proportional to the records that thread has left, so
+ * every set of k records is equally likely. Records are only found, not
+ * parsed, so the pass costs about as much as counting them.
+ *
+ * @param first Start of the buffer, beginning with the header
+ * @param last End of the buffer
+ * @param k Number of records to draw, all records if there are fewer
+ * @param seed Seed of the random generators, the same seed and threads give the same sample
+ * @param sep Field separator
+ * @param pmode Parsing mode, decides which quotes can hide newlines
+ * @param threads Number of threads
+ * @param cancel Cancellation to check, or nullptr
+ * @return Sampled records without the header, in the order of the buffer
+ * @throws cancelled_error If cancelled
+ */
+inline std::vector<std::string> sample_records(const char *first, const char *last,
+                                               const std::size_t k, const std::uint64_t seed = 0,
+                                               const char sep = ',', const mode pmode = mode::strict,
+                                               const unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+                                               const cancellation *cancel = nullptr) {
+    const auto header_end = find_record_end(first, last, sep, pmode);
+    const auto body = header_end == last ? last : header_end + 1;
+
+    const unsigned n = std::max(1u, threads);
+    std::vector<detail::reservoir> reservoirs;
+    for(unsigned i = 0; i < n; ++i) {
+        reservoirs.emplace_back(k, seed * n + i);
+    }
+    parallel_for_each_record(body, last, [&](const unsigned worker, const char *rfirst,
+                                             const char *rlast) {
+        reservoirs[worker].add(rfirst, rlast);
+    }, sep, pmode, n, cancel);
+
+    // Draw which thread each sampled record comes from, then take that
+    // many records from its shuffled reservoir
+    std::mt19937_64 rng(seed);
+    std::vector<std::uint64_t> left;
+    std::uint64_t total = 0;
+    for(auto &r : reservoirs) {
+        left.push_back(r.seen());
+        total += r.seen();
+        std::shuffle(r.sample().begin(), r.sample().end(), rng);
+    }
+
+    std::vector<std::size_t> taken(n);
+    std::vector<detail::record_range> sample;
+    while(sample.size() < k && total != 0) {
+        auto pick = std::uniform_int_distribution<std::uint64_t>(0, total - 1)(rng);
+        std::size_t i = 0;
+        while(pick >= left[i]) {
+            pick -= left[i++];
+        }
+        sample.push_back(reservoirs[i].sample()[taken[i]++]);
+        --left[i];
+        --total;
+    }
+
+    std::sort(sample.begin(), sample.end());
+    std::vector<std::string> records;
+    for(const auto &r : sample) {
+        records.emplace_back(r.first, r.second);
+    }
+    return records;
+}
+
+/**
+ * @brief Write the header and a uniform random sample of records as CSV
+ *
+ * Records are parsed and encoded again, see sample_records() and encode_line().
+ *
+ * @param first Start of the buffer, beginning with the header
+ * @param last End of the buffer
+ * @param out Stream to write to
+ * @param k Number of records to draw
+ * @param seed Seed of the random generators
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @param threads Number of threads
+ * @param cancel Cancellation to check, or nullptr
+ * @throws csv_error If the header or a sampled record is invalid
+ * @throws cancelled_error If cancelled
+ */
+inline void write_sample(const char *first, const char *last, std::ostream &out,
+                         const std::size_t k, const std::uint64_t seed = 0,
+                         const char sep = ',', const mode pmode = mode::strict,
+                         const unsigned threads = std::max(1u, std::thread::hardware_concurrency()),
+                         const cancellation *cancel = nullptr) {
+    const char sep_str[] = {sep, '\0'};
+    std::vector<std::string> fields;
+    const auto write = [&](const std::string &record) {
+        fields.clear();
+        parse_line(record, std::back_inserter(fields), sep, pmode);
+        encode_line(fields.cbegin(), fields.cend(), std::ostream_iterator<std::string>(out),
+                    sep_str);
+        out << '\n';
+    };
+
+    write(std::string(first, find_record_end(first, last, sep, pmode)));
+    for(const auto &record : sample_records(first, last, k, seed, sep, pmode, threads, cancel)) {
+        write(record);
+    }
+}
+
+/**
+ * @brief Estimated summary of a column, see quick_look()
+ */
+struct quick_look_column {
+    std::string name;
+    zone_type type = zone_type::number;  // text if any sampled value is not a number
+    double null_fraction = 0;
+    double mean_length = 0;
+    std::string min;
+    std::string max;
+    std::vector<std::pair<std::string, double>> top;  // most frequent values and their share
+};
+
+/**
+ * @brief Estimated summary of a CSV, see quick_look()
+ */
+struct quick_look_result {
+    std::uint64_t rows = 0;       // estimated number of rows, without the header
+    std::size_t sampled_rows = 0;
+    bool exact = false;           // the whole file was read
+    std::vector<quick_look_column> columns;
+};
+
+namespace detail {
+
+// Records that start and end inside a block, assuming the block starts
+// in_quotes. Starts after the first record boundary unless at_start, and
+// includes a last record without a newline if at_end.
+inline std::vector<record_range> block_records(const char *first, const char *last,
+                                               const char sep, const mode pmode,
+                                               const bool in_quotes, const bool at_start,
+                                               const bool at_end = false) {
+    std::vector<record_range> records;
+    auto it = first;
+    if(!at_start) {
+        const auto end = find_record_end(first, last, in_quotes, sep, pmode);
+        it = end == last ? last : end + 1;
+    }
+    while(it != last) {
+        const auto end = find_record_end(it, last, false, sep, pmode);
+        if(end == last && !at_end) {
+            break;
+        }
+        records.emplace_back(it, end);
+        it = end == last ? last : end + 1;
+    }
+    return records;
+}
+
+} // namespace detail
+
+/**
+ * @brief Estimate the size and contents of a CSV from a few random blocks
+ *
+ * Reads the header, the block after it and one block at a random position
+ * in each of blocks - 1 equal parts of the rest of the stream. The quote state at the start of
+ * a block is unknown, so both states are tried, and the one whose records
+ * have the header's field count is used to find the first record boundary.
+ * The stream is read completely only if it is smaller than the blocks.
+ *
+ * @param in Seekable stream positioned at the header, opened in binary mode
+ * @param blocks Number of blocks to read
+ * @param block_size Size of each block in bytes
+ * @param seed Seed for the block positions
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @return Estimates
+ * @throws csv_error If the header is invalid
+ */
+inline quick_look_result quick_look(std::istream &in, const std::size_t blocks = 16,
+                                    const std::size_t block_size = 1 << 16,
+                                    const std::uint64_t seed = 0, const char sep = ',',
+                                    const mode pmode = mode::strict) {
+    const auto start = static_cast<std::uint64_t>(in.tellg());
+    in.seekg(0, std::ios::end);
+    const auto size = static_cast<std::uint64_t>(in.tellg()) - start;
+
+    quick_look_result result;
+    result.exact = size <= blocks * block_size;
+    const auto read_block = [&](const std::uint64_t offset, const std::size_t n) {
+        std::string block(n, '\0');
+        in.clear();
+        in.seekg(static_cast<std::streamoff>(start + offset));
+        in.read(&block[0], static_cast<std::streamsize>(n));
+        block.resize(static_cast<std::size_t>(in.gcount()));
+        return block;
+    };
+
+    // The header may be longer than a block, so it is read on its own
+    std::string head;
+    std::size_t header_length = 0;
+    for(auto n = std::max<std::size_t>(block_size, 1); ; n *= 2) {
+        head = read_block(0, n);
+        header_length = static_cast<std::size_t>(
+            find_record_end(head.data(), head.data() + head.size(), sep, pmode) - head.data());
+        if(header_length != head.size() || head.size() < n) {
+            break;
+        }
+    }
+    std::vector<std::string> header;
+    parse_line(head.substr(0, header_length), std::back_inserter(header), sep, pmode);
+    const auto header_size = std::min<std::uint64_t>(header_length + 1, size);
+    const auto rest = size - header_size;
+
+    // The first block starts after the header, the rest are stratified
+    std::vector<std::string> data;
+    data.push_back(read_block(header_size,
+                              result.exact ? static_cast<std::size_t>(rest) : block_size));
+    if(result.exact && !data.back().empty() && data.back().back() != '\n') {
+        data.back() += '\n';
+    }
+
+    std::mt19937_64 rng(seed);
+    if(!result.exact && blocks > 1 && rest > block_size) {
+        const auto stride = (rest - block_size) / (blocks - 1);
+        for(std::size_t i = 1; i < blocks; ++i) {
+            const auto offset = block_size + (i - 1) * stride
+                                + std::uniform_int_distribution<std::uint64_t>(
+                                      0, stride > block_size ? stride - block_size : 0)(rng);
+            data.push_back(read_block(header_size + std::min(offset, rest - block_size), block_size));
+        }
+    }
+
+    std::vector<detail::record_range> records;
+    for(std::size_t i = 0; i < data.size(); ++i) {
+        const auto first = data[i].data();
+        const auto last = data[i].data() + data[i].size();
+        const auto score = [&](const std::vector<detail::record_range> &recs) {
+            return std::count_if(recs.cbegin(), recs.cend(), [&](const auto &r) {
+                return count_fields(r.first, r.second, sep, pmode) == header.size();
+            });
+        };
+
+        auto best = detail::block_records(first, last, sep, pmode, false, i == 0);
+        if(i != 0) {
+            auto quoted = detail::block_records(first, last, sep, pmode, true, false);
+            if(score(quoted) > score(best)) {
+                best = std::move(quoted);
+            }
+        }
+        records.insert(records.end(), best.cbegin(), best.cend());
+    }
+
+    // Collect the sampled values of each column
+    std::vector<std::vector<std::string>> values(header.size());
+    std::vector<std::size_t> nulls(header.size());
+    std::uint64_t sampled_bytes = 0;
+    std::vector<lazy_field<const char *>> fields;
+    for(const auto &r : records) {
+        fields.clear();
+        try {
+            split_line(detail::char_range{r.first, r.second}, std::back_inserter(fields), sep, pmode);
+        }
+        catch(const csv_error &) {
+            continue;
+        }
+
+        ++result.sampled_rows;
+        sampled_bytes += static_cast<std::uint64_t>(r.second - r.first) + 1;
+        for(std::size_t i = 0; i < std::min(fields.size(), header.size()); ++i) {
+            if(fields[i].begin() == fields[i].end() && !fields[i].quoted()) {
+                ++nulls[i];
+            }
+            else {
+                values[i].push_back(fields[i].str());
+            }
+        }
+    }
+
+    if(result.exact) {
+        result.rows = result.sampled_rows;
+    }
+    else if(sampled_bytes != 0) {
+        result.rows = static_cast<std::uint64_t>(
+            static_cast<double>(size - header_size) * static_cast<double>(result.sampled_rows)
+            / static_cast<double>(sampled_bytes) + 0.5);
+    }
+
+    for(std::size_t i = 0; i < header.size(); ++i) {
+        quick_look_column col;
+        col.name = header[i];
+        auto &v = values[i];
+        double x = 0;
+        col.type = std::all_of(v.cbegin(), v.cend(), [&x](const std::string &s) {
+            return detail::to_number(s, x);
+        }) ? zone_type::number : zone_type::text;
+        if(result.sampled_rows != 0) {
+            col.null_fraction = static_cast<double>(nulls[i]) / static_cast<double>(result.sampled_rows);
+        }
+
+        std::unordered_map<std::string, std::size_t> counts;
+        std::size_t length = 0;
+        for(const auto &s : v) {
+            ++counts[s];
+            length += s.size();
+        }
+        if(!v.empty()) {
+            const auto less = [&col](const std::string &a, const std::string &b) {
+                return detail::zone_less(col.type, a, b);
+            };
+            col.mean_length = static_cast<double>(length) / static_cast<double>(v.size());
+            col.min = *std::min_element(v.cbegin(), v.cend(), less);
+            col.max = *std::max_element(v.cbegin(), v.cend(), less);
+        }
+
+        std::vector<std::pair<std::string, std::size_t>> top(counts.cbegin(), counts.cend());
+        const auto n = std::min<std::size_t>(top.size(), 5);
+        std::partial_sort(top.begin(), top.begin() + static_cast<std::ptrdiff_t>(n), top.end(),
+                          [](const auto &a, const auto &b) {
+            return a.second > b.second || (a.second == b.second && a.first < b.first);
+        });
+        for(std::size_t j = 0; j < n; ++j) {
+            col.top.emplace_back(top[j].first, static_cast<double>(top[j].second)
+                                               / static_cast<double>(v.size()));
+        }
+        result.columns.push_back(std::move(col));
+    }
+    return result;
+}
+
+namespace detail {
+
+// Records before the last n that tail_records() also verifies
+const std::size_t tail_lookahead = 16;
+
+// Largest window tail_records() reads, in blocks
+const std::size_t tail_max_blocks = 256;
+
+} // namespace detail
+
+/**
+ * @brief Read the last records of a stream without reading it from the start
+ *
+ * Reads a window at the end of the stream. Whether the window starts inside
+ * a quoted field is unknown, so the records are split both ways. Each split
+ * is scored by how many of its last n + 16 records have the header's field
+ * count, and the higher score wins, so a few ragged records don't matter.
+ * The window grows while the splits tie or have too few records, which
+ * usually takes one block. It stops at the start of the stream, where the
+ * quote state is known, or at 256 blocks, so fewer than n records may be
+ * returned if they are very long.
+ *
+ * @param in Seekable stream positioned at the header, opened in binary mode
+ * @param n Number of records
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @param block_size Size of the first window in bytes
+ * @param cancel Cancellation checked whenever the window grows, or nullptr
+ * @return Up to n last records, without the header, in the order of the stream
+ * @throws csv_error If the header is invalid
+ * @throws cancelled_error If cancelled
+ */
+inline std::vector<std::string> tail_records(std::istream &in, const std::size_t n,
+                                             const char sep = ',',
+                                             const mode pmode = mode::strict,
+                                             const std::size_t block_size = 1 << 16,
+                                             const cancellation *cancel = nullptr) {
+    if(n == 0) {
+        return {};
+    }
+    const auto header = head(in, 0, sep, pmode);
+    if(header.empty()) {
+        return {};
+    }
+    const auto columns = header[0].size();
+    in.clear();
+    const auto body = static_cast<std::uint64_t>(in.tellg());
+    in.seekg(0, std::ios::end);
+    const auto size = static_cast<std::uint64_t>(in.tellg());
+
+    // Only the records that can be returned, and a few before them, are verified
+    const auto wanted = n + detail::tail_lookahead;
+    const auto tail_of = [&](const std::vector<detail::record_range> &records) {
+        return records.cend() - static_cast<std::ptrdiff_t>(std::min(records.size(), wanted));
+    };
+    const auto score = [&](const std::vector<detail::record_range> &records) {
+        std::vector<lazy_field<const char *>> fields;
+        return std::count_if(tail_of(records), records.cend(), [&](const auto &r) {
+            fields.clear();
+            try {
+                split_line(detail::char_range{r.first, r.second}, std::back_inserter(fields),
+                           sep, pmode);
+            }
+            catch(const csv_error &) {
+                return false;
+            }
+            return fields.size() == columns;
+        });
+    };
+    const auto same_tail = [&](const std::vector<detail::record_range> &a,
+                               const std::vector<detail::record_range> &b) {
+        return std::distance(tail_of(a), a.cend()) == std::distance(tail_of(b), b.cend())
+               && std::equal(tail_of(a), a.cend(), tail_of(b));
+    };
+
+    const std::uint64_t block = std::max<std::size_t>(block_size, 1);
+    const auto max_window = block * detail::tail_max_blocks;
+    std::string window;
+    std::vector<detail::record_range> records;
+    for(auto w = block; ; w = std::min(w * 4, max_window)) {
+        if(cancel != nullptr) {
+            cancel->check();
+        }
+
+        const auto begin = size - std::min(w, size - body);
+        window.resize(static_cast<std::size_t>(size - begin));
+        in.seekg(static_cast<std::streamoff>(begin));
+        in.read(&window[0], static_cast<std::streamsize>(window.size()));
+
+        const auto first = window.data();
+        const auto last = first + window.size();
+        if(begin == body) {
+            records = detail::block_records(first, last, sep, pmode, false, true, true);
+            break;
+        }
+
+        auto plain = detail::block_records(first, last, sep, pmode, false, false, true);
+        auto quoted = detail::block_records(first, last, sep, pmode, true, false, true);
+        const auto plain_score = score(plain);
+        const auto quoted_score = score(quoted);
+        auto &best = quoted_score > plain_score ? quoted : plain;
+        const bool decided = plain_score != quoted_score || same_tail(plain, quoted);
+        if((decided && best.size() >= wanted) || w == max_window) {
+            records = std::move(best);
+            break;
+        }
+    }
+
+    std::vector<std::string> result;
+    const auto skip = records.size() - std::min(n, records.size());
+    for(auto it = records.cbegin() + static_cast<std::ptrdiff_t>(skip); it != records.cend(); ++it) {
+        result.emplace_back(it->first, it->second);
+    }
+    return result;
+}
+
+/**
+ * @brief Parse the last records of a stream, see tail_records()
+ * @return Up to n last rows, without the header, in the order of the stream
+ * @throws csv_error If the header or one of the records is invalid
+ * @throws cancelled_error If cancelled
+ */
+inline std::vector<std::vector<std::string>> tail(std::istream &in, const std::size_t n,
+                                                  const char sep = ',',
+                                                  const mode pmode = mode::strict,
+                                                  const std::size_t block_size = 1 << 16,
+                                                  const cancellation *cancel = nullptr) {
+    std::vector<std::vector<std::string>> rows;
+    for(const auto &record : tail_records(in, n, sep, pmode, block_size, cancel)) {
+        rows.emplace_back();
+        parse_line(record, std::back_inserter(rows.back()), sep, pmode);
+    }
+    return rows;
+}
+
+namespace detail {
+
+/**
+ * @brief Output iterator that appends strings to a string
+ */
+class string_appender {
+    std::string *_s;
+
+public:
+    explicit string_appender(std::string &s) : _s(&s) {}
+
+    string_appender& operator++() {
+        return *this;
+    }
+    string_appender& operator++(int) {
+        return *this;
+    }
+    string_appender& operator*() {
+        return *this;
+    }
+    string_appender& operator=(const std::string &s) {
+        *_s += s;
+        return *this;
+    }
+};
+
+} // namespace detail
+
+/**
+ * @brief Compressor that leaves blocks unchanged
+ */
+struct no_compression {
+    std::string operator()(std::string block) const {
+        return block;
+    }
+};
+
+/**
+ * @brief Write encoded CSV in independently compressed blocks
+ *
+ * Rows are collected into blocks of about block_size bytes. Each block is
+ * compressed on its own thread and the results are written in order, so
+ * compression is no longer limited to one core. Complete gzip members
+ * (as in BGZF) and zstd frames can be concatenated, so a compressor that
+ * returns one of them per block produces a valid compressed file.
+ *
+ * @pre Compressor must be callable with std::string and return std::string,
+ *      and be safe to call from several threads at once
+ */
+template <class Compressor = no_compression>
+class block_writer {
+public:
+    /**
+     * @param out Stream to write to
+     * @param compress Compressor for each block
+     * @param block_size Uncompressed block size in bytes
+     * @param threads Maximum number of blocks compressed at once
+     */
+    explicit block_writer(std::ostream &out, Compressor compress = Compressor(),
+                          const std::size_t block_size = 1 << 20,
+                          const unsigned threads = std::max(1u, std::thread::hardware_concurrency()))
+        : _out(out), _compress(std::move(compress)), _block_size(block_size),
+          _threads(std::max(1u, threads)) {}
+
+    block_writer(const block_writer &) = delete;
+    block_writer& operator=(const block_writer &) = delete;
+
+    /**
+     * @brief Finish writing, ignoring errors; call close() to see them
+     */
+    ~block_writer() {
+        try {
+            close();
+        }
+        catch(...) {
+        }
+    }
+
+    /**
+     * @brief Encode and write a row, see encode_line()
+     * @pre InIter must satisfy InputIterator
+     * @param start Iterator to the first field
+     * @param end Iterator to one past the last field
+     * @param sep Field separator
+     */
+    template <class InIter>
+    void write_row(InIter start, InIter end, const char *sep = ",") {
+        encode_line(start, end, detail::string_appender(_block), sep);
+        _block += '\n';
+        if(_block.size() >= _block_size) {
+            submit();
+        }
+    }
+
+    /**
+     * @brief Compress and write all pending blocks
+     * @throws Whatever the compressor throws
+     */
+    void close() {
+        if(!_block.empty()) {
+            submit();
+        }
+        while(!_pending.empty()) {
+            write_front();
+        }
+        _out.flush();
+    }
+
+private:
+    void submit() {
+        if(_pending.size() >= _threads) {
+            write_front();
+        }
+
+        const Compressor &compress = _compress;
+        _pending.push_back(std::async(std::launch::async, [&compress](std::string block) {
+            return compress(std::move(block));
+        }, std::move(_block)));
+        _block.clear();
+    }
+
+    void write_front() {
+        auto future = std::move(_pending.front());
+        _pending.pop_front();
+        const auto data = future.get();
+        _out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+    std::ostream &_out;
+    const Compressor _compress;
+    const std::size_t _block_size;
+    const unsigned _threads;
+    std::string _block;
+    std::deque<std::future<std::string>> _pending;
+};
+
+/**
+ * @brief Default policy for converting fields to and from struct members
+ *
+ * Supports std::string, integral and floating point members.
+ * Custom converters must provide from_string(field, member)
+ * and to_string(member) for every member type they map.
+ */
+struct default_converter {
+    static void from_string(std::string &&s, std::string &value) {
+        value = std::move(s);
+    }
+
+    static void from_string(const std::string &s, std::string &value) {
+        value = s;
+    }
+
+    template <class T>
+    static std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value>
+    from_string(const std::string &s, T &value) {
+        char *end = nullptr;
+        errno = 0;
+        const long long v = std::strtoll(s.c_str(), &end, 10);
+        if(!starts_number(s) || end != s.c_str() + s.size() || errno == ERANGE
+                || v < std::numeric_limits<T>::min() || v > std::numeric_limits<T>::max()) {
+            throw csv_error("Invalid integer field");
+        }
+        value = static_cast<T>(v);
+    }
+
+    template <class T>
+    static std::enable_if_t<std::is_integral<T>::value && std::is_unsigned<T>::value>
+    from_string(const std::string &s, T &value) {
+        char *end = nullptr;
+        errno = 0;
+        const unsigned long long v = std::strtoull(s.c_str(), &end, 10);
+        // strtoull() accepts and negates a minus sign
+        if(!starts_number(s) || s[0] == '-' || end != s.c_str() + s.size() || errno == ERANGE
+                || v > std::numeric_limits<T>::max()) {
+            throw csv_error("Invalid integer field");
+        }
+        value = static_cast<T>(v);
+    }
+
+    template <class T>
+    static std::enable_if_t<std::is_floating_point<T>::value>
+    from_string(const std::string &s, T &value) {
+        char *end = nullptr;
+        errno = 0;
+        const long double v = std::strtold(s.c_str(), &end);
+        if(!starts_number(s) || end != s.c_str() + s.size() || errno == ERANGE) {
+            throw csv_error("Invalid floating point field");
+        }
+        value = static_cast<T>(v);
+    }
+
+    static const std::string &to_string(const std::string &value) {
+        return value;
+    }
+
+    template <class T>
+    static std::enable_if_t<std::is_integral<T>::value, std::string>
+    to_string(const T value) {
+        return std::to_string(value);
+    }
+
+    template <class T>
+    static std::enable_if_t<std::is_floating_point<T>::value, std::string>
+    to_string(const T value) {
+        // Enough digits to round-trip the value
+        char buf[64];
+        const int len = std::snprintf(buf, sizeof(buf), "%.*Lg",
+                                      std::numeric_limits<T>::max_digits10,
+                                      static_cast<long double>(value));
+        return std::string(buf, static_cast<std::size_t>(len));
+    }
+
+private:
+    // strto* skip leading whitespace, so check that a number starts right away
+    static bool starts_number(const std::string &s) {
+        return !s.empty() && std::isspace(static_cast<unsigned char>(s[0])) == 0;
+    }
+};
+
+/**
+ * @brief Compile-time list of struct members mapped to CSV columns
+ *
+ * Column i of a record maps to the i-th member pointer. Create with fields().
+ */
+template <class T, class ...Members>
+struct field_list {
+    std::tuple<Members T::*...> members;
+
+    static constexpr std::size_t size() {
+        return sizeof...(Members);
+    }
+};
+
+/**
+ * @brief Describe the CSV columns of a struct
+ *
+ * Example: sfcsv::fields(&Trade::id, &Trade::px, &Trade::qty)
+ *
+ * @param members Member pointers in column order
+ * @return Field list for parse_struct() and encode_struct()
+ */
+template <class T, class ...Members>
+constexpr field_list<T, Members...> fields(Members T::*...members) {
+    return field_list<T, Members...>{std::make_tuple(members...)};
+}
+
+namespace detail {
+
+template <std::size_t I, class Converter, class T, class StringT, class Tuple>
+void assign_member(T &obj, const Tuple &members, StringT &&s) {
+    Converter::from_string(std::move(s), obj.*std::get<I>(members));
+}
+
+/**
+ * @brief Failed conversion of a struct field, given a position by parse_struct()
+ */
+struct field_failure {
+    std::size_t field;
+    std::string message;
+};
+
+/**
+ * @brief Output iterator that assigns parsed fields straight into struct members
+ *
+ * Fields past the member count are counted and dropped.
+ */
+template <class Converter, class T, class StringT, class Tuple, class Indices>
+class member_inserter;
+
+template <class Converter, class T, class StringT, class Tuple, std::size_t ...I>
+class member_inserter<Converter, T, StringT, Tuple, std::index_sequence<I...>> {
+    using assign_fn = void (*)(T &, const Tuple &, StringT &&);
+
+    T *_obj;
+    const Tuple *_members;
+    std::size_t *_count;
+
+public:
+    member_inserter(T &obj, const Tuple &members, std::size_t &count)
+        : _obj(&obj), _members(&members), _count(&count) {}
+
+    member_inserter& operator++() {
+        return *this;
+    }
+    member_inserter& operator++(int) {
+        return *this;
+    }
+    member_inserter& operator*() {
+        return *this;
+    }
+    member_inserter& operator=(StringT &&s) {
+        static constexpr assign_fn table[] = {
+            &assign_member<I, Converter, T, StringT, Tuple>...
+        };
+        if(*_count < sizeof...(I)) {
+            try {
+                table[*_count](*_obj, *_members, std::move(s));
+            }
+            catch(const csv_error &e) {
+                throw field_failure{*_count, e.what()};
+            }
+        }
+        ++*_count;
+        return *this;
+    }
+};
+
+template <class Converter, class T, class Tuple, class OutIter, class CharT, std::size_t ...I>
+void encode_members(const T &obj, const Tuple &members, OutIter &out, const CharT *sep,
+                    std::index_sequence<I...>) {
+    bool first = true;
+    (void)std::initializer_list<int>{(
+        (first ? (void)(first = false) : (void)(*out++ = sep)),
+        (void)(*out++ = encode_field(std::string(Converter::to_string(obj.*std::get<I>(members))))),
+        0)...};
+}
+
+} // namespace detail
+
+/**
+ * @brief Parse a CSV line directly into struct members
+ *
+ * Each field is converted with Converter as soon as it is parsed,
+ * so no intermediate row of strings is built.
+ *
+ * @pre StringT must satisfy the parse_line() requirements
+ * @pre Converter must support from_string(StringT&&, Member&) for every member
+ * @param s String to parse
+ * @param obj Struct to fill
+ * @param fl Field list created with fields()
+ * @param sep Field separator
+ * @param pmode Parsing mode
+ * @throws csv_error If the line is invalid (see parse_line())
+ * @throws csv_error If the field count does not match the field list
+ * @throws csv_error If a field cannot be converted to its member type
+ */
+template <class StringPolicy = default_policy, class Converter = default_converter,
+          class StringT, class T, class ...Members,
+          class CharT = typename StringT::value_type>
+void parse_struct(const StringT& s, T &obj, const field_list<T, Members...> &fl,
+                  const CharT sep = ',', const mode pmode = mode::strict) {
+    std::size_t count = 0;
+    try {
+        parse_line<StringPolicy>(s, detail::member_inserter<Converter, T, StringT,
+                                 decltype(fl.members), std::index_sequence_for<Members...>>(
+                                     obj, fl.members, count), sep, pmode);
+    }
+    catch(const detail::field_failure &f) {
+        throw detail::line_error(f.message.c_str(), s.cbegin(),
+                                 detail::field_begin(s.cbegin(), s.cend(), sep, pmode, f.field),
+                                 s.cend(), sep, pmode);
+    }
+    if(count > sizeof...(Members)) {
+        throw detail::line_error("Too many fields for struct", s.cbegin(),
+                                 detail::field_begin(s.cbegin(), s.cend(), sep, pmode,
+                                                     sizeof...(Members)),
+                                 s.cend(), sep, pmode);
+    }
+    if(count < sizeof...(Members)) {
+        throw detail::line_error("Too few fields for struct", s.cbegin(), s.cend(), s.cend(), sep,
+                                 pmode);
+    }
+}
+
+/**
+ * @brief Encode struct members as a CSV line
+ * @pre Converter must support to_string(Member) for every member
+ * @pre OutIter must satisfy OutputIterator
+ * @param obj Struct to encode
+ * @param fl Field list created with fields()
+ * @param out Iterator to output
+ * @param sep Field separator
+ */
+template <class Converter = default_converter, class T, class ...Members,
+          class OutIter, class CharT = char>
+void encode_struct(const T &obj, const field_list<T, Members...> &fl, OutIter out,
+                   const CharT* sep = ",") {
+    detail::encode_members<Converter>(obj, fl.members, out, sep,
+                                      std::index_sequence_for<Members...>());
+}
+
 } // namespace sfcsv
 
 #endif // SFCSV_H
@@ -24,13 +24,27 @@ THE SOFTWARE.
 
 *****************************************************************************/
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <iterator>
 #include <vector>
 #include <string>
+#include <thread>
 #include <QList>
 #include <QString>
 #include "sfcsv.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <unistd.h>
+#include "tools/sfcsvd.h"
+#endif
 #include "gtest/gtest.h"
 
 class ParserTest : public ::testing::Test {
@@ -69,6 +83,43 @@ protected:
     }
 };
 
+#if defined(__unix__) || defined(__APPLE__)
+// Tests that write files get a fresh directory under TMPDIR,
+// removed with everything in it after the test
+class TempDirTest : public ParserTest {
+protected:
+    std::string dir;
+
+    void SetUp() override {
+        const char *tmp = std::getenv("TMPDIR");
+        std::string pattern = std::string(tmp != nullptr && *tmp != '\0' ? tmp : "/tmp")
+                              + "/sfcsv_test.XXXXXX";
+        ASSERT_NE(nullptr, ::mkdtemp(&pattern[0]));
+        dir = pattern;
+    }
+
+    void TearDown() override {
+        if(dir.empty()) {
+            return;
+        }
+        if(DIR *d = ::opendir(dir.c_str())) {
+            while(const dirent *e = ::readdir(d)) {
+                const std::string name = e->d_name;
+                if(name != "." && name != "..") {
+                    std::remove((dir + "/" + name).c_str());
+                }
+            }
+            ::closedir(d);
+        }
+        ::rmdir(dir.c_str());
+    }
+
+    std::string path(const std::string &name) const {
+        return dir + "/" + name;
+    }
+};
+#endif
+
 TEST_F(ParserTest, NonQuotedFields)
 {	
     parse("hello");
@@ -308,6 +359,1020 @@ TEST_F(ParserTest, LooseNewlinesInNonQuotedFields)
     EXPECT_TRUE(vec_eq("hello\nworld"));
 }
 
+TEST_F(ParserTest, FixedArity)
+{
+    const auto row = sfcsv::parse_line<3>(std::string(R"(hello,"wor,ld",100.0)"));
+    EXPECT_EQ("hello", row[0]);
+    EXPECT_EQ("wor,ld", row[1]);
+    EXPECT_EQ("100.0", row[2]);
+
+    const auto semi = sfcsv::parse_line<2>(std::string("a;b"), ';');
+    EXPECT_EQ("a", semi[0]);
+    EXPECT_EQ("b", semi[1]);
+
+    EXPECT_ANY_THROW(sfcsv::parse_line<3>(std::string("a,b")));
+    EXPECT_ANY_THROW(sfcsv::parse_line<3>(std::string("a,b,c,d")));
+    EXPECT_ANY_THROW(sfcsv::parse_line<2>(std::string(R"("a" ,b)")));
+}
+
+TEST_F(ParserTest, Reader)
+{
+    std::istringstream in("id,text\n1,\"multi\nline\"\n2,plain\n");
+    sfcsv::reader r(in);
+    ASSERT_TRUE(r.read_row(std::back_inserter(result)));
+    EXPECT_TRUE(vec_eq("id", "text"));
+
+    result.clear();
+    ASSERT_TRUE(r.read_row(std::back_inserter(result)));
+    EXPECT_TRUE(vec_eq("1", "multi\nline"));
+    EXPECT_EQ(8u, r.record_offset());
+
+    result.clear();
+    ASSERT_TRUE(r.read_row(std::back_inserter(result)));
+    EXPECT_TRUE(vec_eq("2", "plain"));
+    EXPECT_EQ(3u, r.record_number());
+
+    EXPECT_FALSE(r.read_row(std::back_inserter(result)));
+}
+
+TEST_F(ParserTest, ReaderLooseQuotes)
+{
+    // Bare quotes in non-quoted fields don't open a quoted field in loose mode
+    std::istringstream in("a,b\n5\" pipe,x\n2,\"y\nz\"\n3,\"w\"\"\"\n");
+    sfcsv::reader r(in, ',', sfcsv::mode::loose);
+    std::vector<std::string> record;
+    std::string rec;
+    while(r.read_record(rec)) {
+        record.push_back(rec);
+    }
+    ASSERT_EQ(4u, record.size());
+    EXPECT_EQ("5\" pipe,x", record[1]);
+    EXPECT_EQ("2,\"y\nz\"", record[2]);
+    EXPECT_EQ("3,\"w\"\"\"", record[3]);
+
+    // Field counts follow the same rules
+    const std::string bare = "x\"y,z\",w";
+    EXPECT_EQ(3u, sfcsv::count_fields(bare.cbegin(), bare.cend(), ',', sfcsv::mode::loose));
+    EXPECT_EQ(2u, sfcsv::count_fields(bare.cbegin(), bare.cend(), ','));
+
+    in.clear();
+    in.seekg(0);
+    sfcsv::reader checked(in, ',', sfcsv::mode::loose, sfcsv::column_check::report);
+    while(checked.read_record(rec)) {
+    }
+    EXPECT_TRUE(checked.ragged().empty());
+}
+
+TEST_F(ParserTest, RaggedRecords)
+{
+    const std::string csv = "a,b,c\n1,2,3\n1,\"2,3\"\n1,2,3,4\n";
+    EXPECT_EQ(3u, sfcsv::count_fields(csv.cbegin(), csv.cbegin() + 5, ','));
+
+    std::istringstream in(csv);
+    const auto ragged = sfcsv::find_ragged(in, ',');
+    ASSERT_EQ(2u, ragged.size());
+    EXPECT_EQ(2u, ragged[0].record);
+    EXPECT_EQ(12u, ragged[0].offset);
+    EXPECT_EQ(2u, ragged[0].fields);
+    EXPECT_EQ(3u, ragged[1].record);
+    EXPECT_EQ(4u, ragged[1].fields);
+
+    std::istringstream strict(csv);
+    sfcsv::reader r(strict, ',', sfcsv::mode::strict, sfcsv::column_check::enforce);
+    std::string record;
+    EXPECT_TRUE(r.read_record(record));
+    EXPECT_TRUE(r.read_record(record));
+    EXPECT_ANY_THROW(r.read_record(record));
+}
+
+TEST_F(ParserTest, LazyFields)
+{
+    using field = sfcsv::lazy_field<std::string::const_iterator>;
+
+    const std::string csv = R"(plain,"quoted","say ""hi""",,"")";
+    std::vector<field> fields;
+    sfcsv::split_line(csv, std::back_inserter(fields), ',');
+    ASSERT_EQ(5u, fields.size());
+    EXPECT_FALSE(fields[0].escaped());
+    EXPECT_EQ("plain", std::string(fields[0].begin(), fields[0].end()));
+    EXPECT_FALSE(fields[1].escaped());
+    EXPECT_EQ("quoted", std::string(fields[1].begin(), fields[1].end()));
+    EXPECT_TRUE(fields[2].escaped());
+    EXPECT_EQ(R"(say "hi")", fields[2].str());
+    EXPECT_EQ("", fields[3].str());
+    EXPECT_EQ("", fields[4].str());
+
+    // Must split and decode exactly like parse_line
+    const std::vector<std::string> lines {
+        "hello,world", R"("hello","wor,ld")", R"("""hello"" world")", R"("""","""""")",
+        R"(,"",)", "\"hello\nworld\"", R"(hello,"this is not a "film",world)",
+        R"(hello,"this is not a """film",world)", R"(hello,aa""bb,world)",
+        R"(""abc,x)", R"("abc"def)", "hello\nworld", R"("hello" world)", R"(hello "world")"
+    };
+    for(const auto m : {sfcsv::mode::strict, sfcsv::mode::loose}) {
+        for(const auto& line : lines) {
+            std::vector<std::string> expected;
+            bool expected_throws = false;
+            try {
+                sfcsv::parse_line(line, std::back_inserter(expected), ',', m);
+            }
+            catch(const sfcsv::csv_error&) {
+                expected_throws = true;
+            }
+
+            std::vector<field> lazy;
+            bool lazy_throws = false;
+            try {
+                sfcsv::split_line(line, std::back_inserter(lazy), ',', m);
+            }
+            catch(const sfcsv::csv_error&) {
+                lazy_throws = true;
+            }
+
+            EXPECT_EQ(expected_throws, lazy_throws) << line;
+            if(!expected_throws && !lazy_throws) {
+                std::vector<std::string> decoded;
+                for(const auto& f : lazy) {
+                    decoded.push_back(f.str());
+                }
+                EXPECT_EQ(expected, decoded) << line;
+            }
+        }
+    }
+}
+
+TEST_F(ParserTest, SidecarCache)
+{
+    std::istringstream csv("id,name\n1,\"a \"\"b\"\"\"\n2,\"c\nd\"\n");
+    const auto sig = sfcsv::make_signature(csv);
+    const auto t = sfcsv::build_table(csv);
+    ASSERT_EQ(2u, t.rows());
+    EXPECT_EQ(std::vector<std::string>({"id", "name"}), t.header);
+    EXPECT_EQ(R"(a "b")", t.columns[1][0]);
+    EXPECT_EQ(20u, t.offsets[1]);
+
+    std::stringstream sidecar;
+    sfcsv::save_table(sidecar, t, sig);
+
+    sfcsv::table loaded;
+    ASSERT_TRUE(sfcsv::load_table(sidecar, sig, loaded));
+    EXPECT_EQ(t.header, loaded.header);
+    EXPECT_EQ(t.offsets, loaded.offsets);
+    EXPECT_EQ("2", loaded.columns[0][1]);
+    EXPECT_EQ("c\nd", loaded.columns[1][1]);
+
+    auto stale = sig;
+    stale.mtime = 1;
+    sidecar.clear();
+    sidecar.seekg(0);
+    EXPECT_FALSE(sfcsv::load_table(sidecar, stale, loaded));
+
+    // Corrupt counts and offsets are rejected instead of allocated or trusted
+    const std::string bytes = sidecar.str();
+    const auto corrupt = [&](const std::size_t at, const std::uint64_t value) {
+        std::string b = bytes;
+        std::memcpy(&b[at], &value, sizeof(value));
+        std::istringstream in(b);
+        return sfcsv::load_table(in, sig, loaded);
+    };
+    EXPECT_FALSE(corrupt(36, std::uint64_t(1) << 60));
+    EXPECT_FALSE(corrupt(44, std::uint64_t(1) << 60));
+    EXPECT_FALSE(corrupt(52, std::uint64_t(1) << 60));
+    EXPECT_FALSE(corrupt(90, 5));
+    std::istringstream truncated(bytes.substr(0, bytes.size() - 1));
+    EXPECT_FALSE(sfcsv::load_table(truncated, sig, loaded));
+    std::istringstream intact(bytes);
+    EXPECT_TRUE(sfcsv::load_table(intact, sig, loaded));
+
+    std::istringstream ragged("a,b\n1\n");
+    EXPECT_ANY_THROW(sfcsv::build_table(ragged));
+
+    // A bare quote in loose mode doesn't hide a separator from the field count
+    std::istringstream loose("a,b\nx\"y,z\",w\n");
+    EXPECT_THROW(sfcsv::build_table(loose, ',', sfcsv::mode::loose), sfcsv::csv_error);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+TEST_F(TempDirTest, LoadCached)
+{
+    const std::string csv = path("sidecar.csv");
+    std::ofstream(csv, std::ios::binary) << "id\n1\n";
+    EXPECT_EQ(1u, sfcsv::load_cached(csv, 1).rows());
+    std::ofstream(csv, std::ios::binary) << "id\n2\n";
+    EXPECT_EQ("2", sfcsv::load_cached(csv, 2).columns[0][0]);
+    EXPECT_TRUE(std::ifstream(csv + ".sfcb", std::ios::binary).good());
+}
+#endif
+
+TEST_F(ParserTest, ColumnarTable)
+{
+    std::istringstream csv("id,name\n1,\"a,b\"\n2,\n3,\"\"\n");
+    std::ostringstream out;
+    sfcsv::write_columnar(csv, out);
+
+    // Copy into 8-byte aligned storage as a memory map would provide
+    const std::string bytes = out.str();
+    std::vector<std::uint64_t> buf((bytes.size() + 7) / 8);
+    std::memcpy(buf.data(), bytes.data(), bytes.size());
+
+    const sfcsv::columnar_view view(buf.data(), bytes.size());
+    ASSERT_EQ(3u, view.rows());
+    ASSERT_EQ(2u, view.columns());
+    EXPECT_EQ("id", view.column(0).name());
+    EXPECT_EQ("3", view.column(0)[2]);
+
+    const auto name = view.column(1);
+    EXPECT_EQ("name", name.name());
+    EXPECT_EQ("a,b", name[0]);
+    EXPECT_FALSE(name.is_null(0));
+    EXPECT_TRUE(name.is_null(1));
+    EXPECT_FALSE(name.is_null(2));
+    EXPECT_EQ(0u, name.length(2));
+
+    EXPECT_ANY_THROW(sfcsv::columnar_view(buf.data(), 16));
+
+    // Offsets that wrap around or values out of order are rejected
+    const std::size_t entry = (32 + sizeof(sfcsv::detail::columnar_entry)) / 8;
+    auto bad = buf;
+    bad[entry + 4] = ~std::uint64_t(0) - 2;
+    EXPECT_THROW(sfcsv::columnar_view(bad.data(), bytes.size()), sfcsv::csv_error);
+    bad = buf;
+    bad[bad[entry + 2] / 8 + 1] = 100;
+    EXPECT_THROW(sfcsv::columnar_view(bad.data(), bytes.size()), sfcsv::csv_error);
+
+    std::istringstream loose("a,b\nx\"y,z\",w\n");
+    std::ostringstream loose_out;
+    EXPECT_THROW(sfcsv::write_columnar(loose, loose_out, ',', sfcsv::mode::loose),
+                 sfcsv::csv_error);
+}
+
+TEST_F(ParserTest, ZoneMaps)
+{
+    std::stringstream csv("ts,value\n"
+                          "2024-01-01,5\n2024-01-02,12\n"
+                          "2024-02-01,9\n2024-02-03,n/a\n"
+                          "2024-03-01,100\n");
+    const auto idx = sfcsv::build_block_index(csv, {{0, sfcsv::zone_type::text},
+                                                    {1, sfcsv::zone_type::number}}, {}, 2);
+    ASSERT_EQ(3u, idx.blocks.size());
+    EXPECT_EQ("5", idx.blocks[0].zones[1].min);
+    EXPECT_EQ("12", idx.blocks[0].zones[1].max);
+    EXPECT_EQ("9", idx.blocks[1].zones[1].max);
+
+    EXPECT_EQ(std::vector<std::size_t>({1}), idx.find_range(0, "2024-02-01", "2024-02-28"));
+    EXPECT_EQ(std::vector<std::size_t>({0, 2}), idx.find_range(1, "10", "1000"));
+    EXPECT_EQ(3u, idx.find_range(2, "a", "b").size());
+
+    std::vector<std::string> values;
+    sfcsv::for_each_row(csv, idx.blocks[1], [&](const std::vector<std::string> &row){
+        values.push_back(row[1]);
+    });
+    EXPECT_EQ(std::vector<std::string>({"9", "n/a"}), values);
+
+    std::stringstream sidecar;
+    sfcsv::save_block_index(sidecar, idx, sfcsv::source_signature());
+    sfcsv::block_index loaded;
+    ASSERT_TRUE(sfcsv::load_block_index(sidecar, sfcsv::source_signature(), loaded));
+    EXPECT_EQ(idx.find_range(1, "10", "1000"), loaded.find_range(1, "10", "1000"));
+    EXPECT_EQ(idx.blocks[2].offset, loaded.blocks[2].offset);
+
+    // Unknown zone types and corrupt counts are rejected
+    std::string bad = sidecar.str();
+    bad[52] = 7;
+    std::istringstream bad_type(bad);
+    EXPECT_FALSE(sfcsv::load_block_index(bad_type, sfcsv::source_signature(), loaded));
+    bad = sidecar.str();
+    const std::uint64_t huge = std::uint64_t(1) << 60;
+    std::memcpy(&bad[36], &huge, sizeof(huge));
+    std::istringstream bad_count(bad);
+    EXPECT_FALSE(sfcsv::load_block_index(bad_count, sfcsv::source_signature(), loaded));
+}
+
+TEST_F(ParserTest, BloomFilters)
+{
+    std::ostringstream os;
+    os << "user_id,action\n";
+    for(int i = 0; i < 1000; ++i) {
+        os << "user" << i << ",click\n";
+    }
+
+    std::stringstream csv(os.str());
+    const auto idx = sfcsv::build_block_index(csv, {}, {0}, 100);
+    ASSERT_EQ(10u, idx.blocks.size());
+
+    // No false negatives
+    for(int i = 0; i < 1000; ++i) {
+        const auto found = idx.find_equal(0, "user" + std::to_string(i));
+        EXPECT_NE(found.cend(), std::find(found.cbegin(), found.cend(), std::size_t(i / 100)));
+    }
+
+    std::size_t false_positives = 0;
+    for(int i = 1000; i < 2000; ++i) {
+        false_positives += idx.find_equal(0, "user" + std::to_string(i)).size();
+    }
+    EXPECT_LT(false_positives, 500u);
+
+    // Columns without filters can't be skipped
+    EXPECT_EQ(10u, idx.find_equal(1, "view").size());
+
+    std::stringstream sidecar;
+    sfcsv::save_block_index(sidecar, idx, sfcsv::source_signature());
+    sfcsv::block_index loaded;
+    ASSERT_TRUE(sfcsv::load_block_index(sidecar, sfcsv::source_signature(), loaded));
+    EXPECT_EQ(idx.find_equal(0, "user512"), loaded.find_equal(0, "user512"));
+}
+
+TEST_F(ParserTest, KeyIndex)
+{
+    std::stringstream csv("id,name\n"
+                          "c3,carol\n"
+                          "a1,\"alice\nsmith\"\n"
+                          "b2,bob\n"
+                          "a1,again\n");
+    const auto idx = sfcsv::build_key_index(csv, 0);
+    ASSERT_EQ(4u, idx.entries.size());
+    EXPECT_TRUE(idx.find("zz").empty());
+
+    const auto offsets = idx.find("a1");
+    ASSERT_EQ(2u, offsets.size());
+    ASSERT_TRUE(sfcsv::read_row_at(csv, offsets[0], std::back_inserter(result)));
+    EXPECT_TRUE(vec_eq("a1", "alice\nsmith"));
+
+    result.clear();
+    ASSERT_TRUE(sfcsv::read_row_at(csv, idx.find("b2")[0], std::back_inserter(result)));
+    EXPECT_TRUE(vec_eq("b2", "bob"));
+
+    std::stringstream sidecar;
+    sfcsv::save_key_index(sidecar, idx, sfcsv::source_signature());
+    sfcsv::key_index loaded;
+    ASSERT_TRUE(sfcsv::load_key_index(sidecar, sfcsv::source_signature(), loaded));
+    EXPECT_EQ(offsets, loaded.find("a1"));
+
+    // Unsorted entries and corrupt counts are rejected
+    std::string bad = sidecar.str();
+    bad[60] = 'z';
+    std::istringstream unsorted(bad);
+    EXPECT_FALSE(sfcsv::load_key_index(unsorted, sfcsv::source_signature(), loaded));
+    bad = sidecar.str();
+    const std::uint64_t huge = std::uint64_t(1) << 60;
+    std::memcpy(&bad[44], &huge, sizeof(huge));
+    std::istringstream bad_count(bad);
+    EXPECT_FALSE(sfcsv::load_key_index(bad_count, sfcsv::source_signature(), loaded));
+    bad = sidecar.str();
+    std::memcpy(&bad[52], &huge, sizeof(huge));
+    std::istringstream bad_length(bad);
+    EXPECT_FALSE(sfcsv::load_key_index(bad_length, sfcsv::source_signature(), loaded));
+}
+
+TEST_F(ParserTest, LookupCache)
+{
+    std::stringstream csv("id,name\na,alice\nb,bob\nc,carol\n");
+    sfcsv::lookup_table table(csv, sfcsv::build_key_index(csv, 0), 2);
+
+    EXPECT_EQ("alice", table.find("a")[0][1]);
+    EXPECT_EQ("bob", table.find("b")[0][1]);
+    EXPECT_EQ("alice", table.find("a")[0][1]);
+    EXPECT_EQ(1u, table.hits());
+
+    // Evicts b, the least recently used key
+    EXPECT_EQ("carol", table.find("c")[0][1]);
+    EXPECT_EQ("alice", table.find("a")[0][1]);
+    EXPECT_EQ("bob", table.find("b")[0][1]);
+    EXPECT_EQ(2u, table.hits());
+    EXPECT_EQ(4u, table.misses());
+
+    EXPECT_TRUE(table.find("zz").empty());
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+TEST_F(TempDirTest, LookupDaemon)
+{
+    const std::string csv = path("cities.csv");
+    const std::string socket_path = path("sfcsvd.sock");
+    std::ofstream(csv, std::ios::binary) << "id,city\n1,Oslo\n2,\"Hel,sinki\"\n3,Oslo\n";
+    {
+        std::ifstream in(csv, std::ios::binary);
+        EXPECT_THROW(sfcsvd::load_index(in, path("missing.csv"), 0), std::runtime_error);
+    }
+    {
+        sfcsvd::server_state state(csv, 0, 16, 0);
+        const int server = sfcsvd::listen_at(socket_path);
+        ASSERT_GE(server, 0);
+        std::thread serving([&] {
+            sfcsvd::run(server, state);
+        });
+
+        // A client that never sends must not hold up the others
+        const auto addr = sfcsvd::make_address(socket_path);
+        const int idle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        EXPECT_EQ(0, ::connect(idle, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)));
+
+        std::vector<std::string> lines;
+        EXPECT_TRUE(sfcsvd::request(socket_path, sfcsvd::op_get, 0, "2", lines));
+        EXPECT_EQ(std::vector<std::string>{R"("2","Hel,sinki")"}, lines);
+        lines.clear();
+        EXPECT_TRUE(sfcsvd::request(socket_path, sfcsvd::op_scan, 1, "Oslo", lines));
+        EXPECT_EQ((std::vector<std::string>{R"("1","Oslo")", R"("3","Oslo")"}), lines);
+        lines.clear();
+        EXPECT_FALSE(sfcsvd::request(socket_path, sfcsvd::op_get, 0,
+                                     std::string(sfcsvd::max_value_size + 1, 'x'), lines));
+        EXPECT_FALSE(sfcsvd::request(socket_path, static_cast<sfcsvd::op>(3), 0, "1", lines));
+        EXPECT_TRUE(lines.empty());
+
+        ::close(idle);
+        ::shutdown(server, SHUT_RDWR);
+        serving.join();
+        ::close(server);
+    }
+    EXPECT_TRUE(std::ifstream(csv + ".sfck", std::ios::binary).good());
+}
+#endif
+
+struct TagCompressor {
+    std::string operator()(const std::string &block) const {
+        return "[" + block + "]";
+    }
+};
+
+TEST_F(ParserTest, BlockWriter)
+{
+    std::ostringstream plain;
+    std::ostringstream blocks;
+    {
+        sfcsv::block_writer<> w(plain);
+        sfcsv::block_writer<TagCompressor> tagged(blocks, TagCompressor(), 10, 3);
+        for(int i = 0; i < 100; ++i) {
+            const std::vector<std::string> row {"row", std::to_string(i)};
+            w.write_row(row.cbegin(), row.cend());
+            tagged.write_row(row.cbegin(), row.cend(), ";");
+        }
+    }
+
+    std::istringstream in(plain.str());
+    sfcsv::reader r(in);
+    for(int i = 0; i < 100; ++i) {
+        result.clear();
+        ASSERT_TRUE(r.read_row(std::back_inserter(result)));
+        EXPECT_TRUE(vec_eq("row", std::to_string(i)));
+    }
+
+    // Blocks are written in order, each one compressed separately
+    const auto out = blocks.str();
+    EXPECT_EQ(0u, out.find("[\"row\";\"0\"\n"));
+    EXPECT_EQ(100u, static_cast<std::size_t>(std::count(out.cbegin(), out.cend(), '[')));
+    EXPECT_NE(std::string::npos, out.find("\"row\";\"99\"\n]"));
+}
+
+TEST_F(ParserTest, Utf8Validation)
+{
+    EXPECT_EQ(sfcsv::npos, sfcsv::find_invalid_utf8(std::string("plain ascii text that is long enough")));
+    EXPECT_EQ(sfcsv::npos, sfcsv::find_invalid_utf8(std::string("h\xc3\xa9llo \xe2\x82\xac \xf0\x9f\x98\x80")));
+    EXPECT_EQ(20u, sfcsv::find_invalid_utf8(std::string("ascii run of twenty \xff")));
+    EXPECT_EQ(1u, sfcsv::find_invalid_utf8(std::string("a\xc0\xaf")));      // overlong
+    EXPECT_EQ(0u, sfcsv::find_invalid_utf8(std::string("\xed\xa0\x80")));  // surrogate
+    EXPECT_EQ(0u, sfcsv::find_invalid_utf8(std::string("\xf4\x90\x80\x80")));
+    EXPECT_EQ(2u, sfcsv::find_invalid_utf8(std::string("ab\xe2\x82")));     // truncated
+
+    std::istringstream in("a,b\n\xc3\xa9,ok\nfine,bad\xfe\n");
+    sfcsv::reader r(in);
+    r.set_utf8_validation(true);
+    EXPECT_TRUE(r.read_row(std::back_inserter(result)));
+    EXPECT_TRUE(r.read_row(std::back_inserter(result)));
+    try {
+        r.read_row(std::back_inserter(result));
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_EQ(2u, e.record());
+        EXPECT_EQ(1u, e.field());
+        EXPECT_EQ(18u, e.offset());
+    }
+}
+
+TEST_F(ParserTest, Transcoding)
+{
+    const auto read_all = [](const std::string &bytes, sfcsv::encoding enc, std::size_t block) {
+        std::istringstream src(bytes);
+        sfcsv::utf8_streambuf buf(src, enc, block);
+        std::istream in(&buf);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+
+    const std::string text = "name,price\ncaf\xc3\xa9,\xe2\x82\xac" "5\n\xf0\x9f\x98\x80,x\n";
+    EXPECT_EQ("caf\xc3\xa9 \xe2\x82\xac\xe2\x80\x9c",
+              read_all("caf\xe9 \x80\x93", sfcsv::encoding::cp1252, 64));
+    EXPECT_EQ("caf\xc3\xa9 \xc2\x80", read_all("caf\xe9 \x80", sfcsv::encoding::latin1, 64));
+    EXPECT_EQ(text, read_all("\xef\xbb\xbf" + text, sfcsv::encoding::automatic, 64));
+
+    std::string le("\xff\xfe", 2), be("\xfe\xff", 2);
+    const std::u16string units = u"name,price\ncafé,€5\n\U0001F600,x\n";
+    for(const char16_t u : units) {
+        le += static_cast<char>(u & 0xff);
+        le += static_cast<char>(u >> 8);
+        be += static_cast<char>(u >> 8);
+        be += static_cast<char>(u & 0xff);
+    }
+    // Small blocks split surrogate pairs and code units
+    for(const std::size_t block : {1u, 3u, 17u, 4096u}) {
+        EXPECT_EQ(text, read_all(le, sfcsv::encoding::automatic, block));
+        EXPECT_EQ(text, read_all(be, sfcsv::encoding::automatic, block));
+    }
+    EXPECT_EQ("a\xef\xbf\xbd", read_all(std::string("a\0\x00\xd8", 4), sfcsv::encoding::utf16le, 64));
+
+    std::istringstream src(be);
+    sfcsv::utf8_streambuf buf(src);
+    std::istream in(&buf);
+    sfcsv::reader r(in);
+    EXPECT_TRUE(r.read_row(std::back_inserter(result)));
+    EXPECT_TRUE(r.read_row(std::back_inserter(result)));
+    EXPECT_EQ(sfcsv::encoding::utf16be, buf.source_encoding());
+    EXPECT_EQ("\xe2\x82\xac" "5", result[3]);
+}
+
+TEST_F(ParserTest, ParallelStats)
+{
+    std::string csv = "id,name,note\n";
+    for(int i = 0; i < 1000; ++i) {
+        csv += std::to_string(i) + ",";
+        csv += i % 3 == 0 ? "" : "n" + std::to_string(i);
+        csv += i % 7 == 0 ? ",\"multi\nline, \"\"quoted\"\"\"\n" : ",plain\n";
+    }
+    csv += "1001,\"bad\"quote,x\n1002,,";
+
+    for(const unsigned threads : {1u, 2u, 5u, 16u}) {
+        sfcsv::scan_counters counters(3, threads);
+        std::vector<std::uint64_t> sums(threads);
+        sfcsv::parallel_for_each_row(csv.data(), csv.data() + csv.size(),
+                                     [&](unsigned worker, const std::vector<sfcsv::lazy_field<const char *>> &f) {
+            sums[worker] += std::stoul(f[0].str());
+            EXPECT_EQ(3u, f.size());
+        }, counters);
+
+        const auto stats = counters.snapshot();
+        EXPECT_EQ(1001u, stats.rows);
+        EXPECT_EQ(1u, stats.errors);
+        EXPECT_EQ(csv.size() - 13, stats.bytes);
+        EXPECT_EQ(0u, stats.nulls[0]);
+        EXPECT_EQ(335u, stats.nulls[1]);
+        EXPECT_EQ(1u, stats.nulls[2]);
+        std::uint64_t sum = 0;
+        for(const auto s : sums) {
+            sum += s;
+        }
+        EXPECT_EQ(999u * 1000 / 2 + 1002, sum);
+    }
+
+    // In loose mode a bare quote doesn't open a quoted field, so chunks split at the same records
+    std::string loose = "id,size\n";
+    for(int i = 0; i < 1000; ++i) {
+        loose += std::to_string(i) + (i % 5 == 0 ? ",5\" pipe\n" : ",\"a\nb\"\n");
+    }
+    for(const unsigned threads : {1u, 3u, 8u}) {
+        sfcsv::scan_counters counters(2, threads);
+        std::atomic<std::uint64_t> sum{0};
+        sfcsv::parallel_for_each_row(loose.data(), loose.data() + loose.size(),
+                                     [&](unsigned, const std::vector<sfcsv::lazy_field<const char *>> &f) {
+            sum += std::stoul(f[0].str());
+            EXPECT_EQ(2u, f.size());
+        }, counters, ',', sfcsv::mode::loose);
+        EXPECT_EQ(1000u, counters.snapshot().rows);
+        EXPECT_EQ(0u, counters.snapshot().errors);
+        EXPECT_EQ(999u * 1000 / 2, sum.load());
+    }
+    EXPECT_EQ(1000u, sfcsv::sample_records(loose.data(), loose.data() + loose.size(), 2000, 0, ',',
+                                           sfcsv::mode::loose, 4).size());
+}
+
+TEST_F(ParserTest, ColumnProfile)
+{
+    std::string csv = "id,city,price\n";
+    const char *cities[] = {"Oslo", "Helsinki", "\"Turku, FI\"", "Oslo", "Oslo"};
+    for(int i = 0; i < 20000; ++i) {
+        csv += std::to_string(i) + "," + cities[i % 5] + ",";
+        csv += i % 10 == 0 ? "" : std::to_string(i % 500) + ".5";
+        csv += "\n";
+    }
+
+    const auto p = sfcsv::profile_columns(csv.data(), csv.data() + csv.size(), 2, ',',
+                                          sfcsv::mode::strict, 4);
+    ASSERT_EQ(3u, p.size());
+    EXPECT_EQ("id", p[0].name);
+    EXPECT_EQ(20000u, p[0].values);
+    EXPECT_NEAR(20000.0, static_cast<double>(p[0].distinct), 20000 * 0.05);
+    EXPECT_TRUE(p[0].numeric);
+    EXPECT_EQ("0", p[0].min);
+    EXPECT_EQ("19999", p[0].max);
+
+    EXPECT_FALSE(p[1].numeric);
+    EXPECT_EQ(3u, p[1].distinct);
+    EXPECT_EQ("Helsinki", p[1].min);
+    EXPECT_EQ("Turku, FI", p[1].max);
+    ASSERT_EQ(2u, p[1].top.size());
+    EXPECT_EQ("Oslo", p[1].top[0].first);
+    EXPECT_EQ(12000u, p[1].top[0].second);
+    EXPECT_EQ(4000u, p[1].top[1].second);
+    EXPECT_EQ(12000u, p[1].lengths[3]);  // 4-7 characters
+    EXPECT_EQ(8000u, p[1].lengths[4]);   // 8-15 characters
+
+    EXPECT_EQ(2000u, p[2].nulls);
+    EXPECT_EQ(18000u, p[2].values);
+    EXPECT_TRUE(p[2].numeric);
+    EXPECT_EQ("1.5", p[2].min);
+    EXPECT_EQ("499.5", p[2].max);
+}
+
+TEST_F(ParserTest, ReservoirSample)
+{
+    std::string csv = "id,text\n";
+    for(int i = 0; i < 1000; ++i) {
+        csv += std::to_string(i) + (i % 4 == 0 ? ",\"a\nb\"\n" : ",plain\n");
+    }
+    const auto first = csv.data();
+    const auto last = csv.data() + csv.size();
+
+    // Each record should be drawn about equally often
+    std::vector<int> hits(1000);
+    for(std::uint64_t seed = 0; seed < 400; ++seed) {
+        const auto sample = sfcsv::sample_records(first, last, 50, seed, ',', sfcsv::mode::strict,
+                                                  1 + seed % 4);
+        ASSERT_EQ(50u, sample.size());
+        for(const auto &rec : sample) {
+            ++hits[std::stoi(rec)];
+        }
+        EXPECT_TRUE(std::is_sorted(sample.cbegin(), sample.cend(), [](const auto &a, const auto &b) {
+            return std::stoi(a) < std::stoi(b);
+        }));
+    }
+    EXPECT_GT(*std::min_element(hits.cbegin(), hits.cend()), 2);
+    EXPECT_LT(*std::max_element(hits.cbegin(), hits.cend()), 45);
+    const auto strict = sfcsv::mode::strict;
+    EXPECT_EQ(sfcsv::sample_records(first, last, 10, 7, ',', strict, 3),
+              sfcsv::sample_records(first, last, 10, 7, ',', strict, 3));
+    EXPECT_EQ(1000u, sfcsv::sample_records(first, last, 5000, 1, ',', strict, 3).size());
+
+    std::ostringstream out;
+    sfcsv::write_sample(first, last, out, 3, 0, ',', sfcsv::mode::strict, 2);
+    std::istringstream in(out.str());
+    sfcsv::reader r(in);
+    std::vector<std::string> row;
+    std::size_t rows = 0;
+    while(r.read_row(std::back_inserter(row))) {
+        ASSERT_EQ(2u * ++rows, row.size());
+    }
+    EXPECT_EQ(4u, rows);
+    EXPECT_EQ("id", row[0]);
+}
+
+TEST_F(ParserTest, QuickLook)
+{
+    std::string csv = "id,kind,note\n";
+    for(int i = 0; i < 50000; ++i) {
+        csv += std::to_string(i) + (i % 4 == 0 ? ",b," : ",a,");
+        csv += i % 3 == 0 ? "\"line one\nline \"\"two\"\", x,y,z\"\n" : "\n";
+    }
+
+    std::istringstream in(csv);
+    const auto q = sfcsv::quick_look(in, 8, 4096);
+    EXPECT_FALSE(q.exact);
+    EXPECT_GT(q.sampled_rows, 1000u);
+    EXPECT_NEAR(50000.0, static_cast<double>(q.rows), 50000 * 0.1);
+    ASSERT_EQ(3u, q.columns.size());
+    EXPECT_EQ(sfcsv::zone_type::number, q.columns[0].type);
+    EXPECT_EQ(sfcsv::zone_type::text, q.columns[1].type);
+    ASSERT_EQ(2u, q.columns[1].top.size());
+    EXPECT_EQ("a", q.columns[1].top[0].first);
+    EXPECT_NEAR(0.75, q.columns[1].top[0].second, 0.05);
+    EXPECT_NEAR(2.0 / 3, q.columns[2].null_fraction, 0.05);
+
+    std::istringstream small("a,b\n1,x\n2,\n3,z");
+    const auto s = sfcsv::quick_look(small);
+    EXPECT_TRUE(s.exact);
+    EXPECT_EQ(3u, s.rows);
+    EXPECT_EQ("1", s.columns[0].min);
+    EXPECT_EQ("3", s.columns[0].max);
+    EXPECT_NEAR(1.0 / 3, s.columns[1].null_fraction, 1e-9);
+
+    std::istringstream terminated("a,b\n1,x\n2,\n3,z\n");
+    const auto t = sfcsv::quick_look(terminated);
+    EXPECT_TRUE(t.exact);
+    EXPECT_EQ(3u, t.rows);
+    EXPECT_NEAR(1.0 / 3, t.columns[1].null_fraction, 1e-9);
+
+    // A header longer than a block
+    std::string wide;
+    for(int c = 0; c < 20; ++c) {
+        wide += (c == 0 ? "" : ",") + std::string(300, 'h') + std::to_string(c);
+    }
+    wide += '\n';
+    for(int i = 0; i < 20000; ++i) {
+        for(int c = 0; c < 20; ++c) {
+            wide += (c == 0 ? "" : ",") + std::to_string(i % 10);
+        }
+        wide += '\n';
+    }
+    std::istringstream wide_in(wide);
+    const auto w = sfcsv::quick_look(wide_in, 8, 4096);
+    EXPECT_FALSE(w.exact);
+    ASSERT_EQ(20u, w.columns.size());
+    EXPECT_EQ(std::string(300, 'h') + "19", w.columns[19].name);
+    EXPECT_EQ(sfcsv::zone_type::number, w.columns[19].type);
+    EXPECT_NEAR(20000.0, static_cast<double>(w.rows), 20000 * 0.1);
+}
+
+TEST_F(ParserTest, Head)
+{
+    std::istringstream in("a,b\n1,\"x\ny\"\n2,z\n3,w\n");
+    const auto rows = sfcsv::head(in, 2);
+    ASSERT_EQ(3u, rows.size());
+    EXPECT_EQ("x\ny", rows[1][1]);
+    EXPECT_EQ("2", rows[2][0]);
+    EXPECT_EQ(16, in.tellg());  // nothing after the last record was read
+
+    EXPECT_EQ(4u, sfcsv::head(in.seekg(0), 10).size());
+
+    // An unbalanced quote stops at the size limit instead of the end of the stream
+    std::istringstream broken("a,b\n1,\"unterminated\n" + std::string(1000, 'x') + "\n2,y\n");
+    EXPECT_THROW(sfcsv::head(broken, 5, ',', sfcsv::mode::strict, 100), sfcsv::csv_error);
+    EXPECT_LT(broken.tellg(), 200);
+}
+
+TEST_F(ParserTest, Tail)
+{
+    // Quoted fields hold lines that look like records themselves
+    std::string csv = "id,a,b\n";
+    for(int i = 0; i < 500; ++i) {
+        csv += std::to_string(i);
+        csv += i % 3 == 0 ? ",\"x\n" + std::to_string(-i) + ",y,z\n\",w\n" : ",p,q\n";
+    }
+
+    for(const std::size_t block : {1u, 16u, 64u, 1u << 16}) {
+        std::istringstream in(csv);
+        const auto rows = sfcsv::tail(in, 4, ',', sfcsv::mode::strict, block);
+        ASSERT_EQ(4u, rows.size());
+        EXPECT_EQ("496", rows[0][0]);
+        EXPECT_EQ("x\n-498,y,z\n", rows[2][1]);
+        EXPECT_EQ("499", rows[3][0]);
+    }
+
+    std::istringstream unterminated("id,a\n1,x\n2,\"y\nz\"");
+    EXPECT_EQ((std::vector<std::string>{"1,x", "2,\"y\nz\""}),
+              sfcsv::tail_records(unterminated, 5, ',', sfcsv::mode::strict, 4));
+    std::istringstream header_only("id,a\n");
+    EXPECT_TRUE(sfcsv::tail(header_only, 3).empty());
+
+    // A ragged record near the end must not make the window grow to the whole stream
+    struct counting_buf : std::stringbuf {
+        using std::stringbuf::stringbuf;
+        std::streamsize bytes = 0;
+
+    protected:
+        std::streamsize xsgetn(char *s, const std::streamsize count) override {
+            const auto got = std::stringbuf::xsgetn(s, count);
+            bytes += got;
+            return got;
+        }
+    };
+
+    std::string big = "id,a,b\n";
+    for(int i = 0; i < 20000; ++i) {
+        big += std::to_string(i) + (i == 19998 ? ",r\n" : ",\"p\nq\",r\n");
+    }
+    counting_buf buf(big);
+    std::istream ragged(&buf);
+    const auto rows = sfcsv::tail(ragged, 3, ',', sfcsv::mode::strict, 4096);
+    ASSERT_EQ(3u, rows.size());
+    EXPECT_EQ("19997", rows[0][0]);
+    EXPECT_EQ(2u, rows[1].size());
+    EXPECT_EQ("p\nq", rows[2][1]);
+    EXPECT_LE(buf.bytes, 4096);
+
+    buf.bytes = 0;
+    EXPECT_TRUE(sfcsv::tail_records(ragged.seekg(0), 0).empty());
+    EXPECT_EQ(0, buf.bytes);
+}
+
+TEST_F(ParserTest, RowIndex)
+{
+    std::string csv = "id,note\n";
+    for(int i = 0; i < 3000; ++i) {
+        csv += std::to_string(i) + (i % 7 == 0 ? ",\"a\n\"\"b\"\"\"\n" : ",c\n");
+    }
+    csv += "3000,last";
+
+    std::istringstream in(csv);
+    const auto idx = sfcsv::build_row_index(in, 100);
+    EXPECT_EQ(3001u, idx.rows);
+    EXPECT_EQ(31u, idx.offsets.size());
+    EXPECT_EQ(8u, idx.offsets[0]);
+
+    auto rows = sfcsv::read_rows(in, idx, 1399, 3);
+    ASSERT_EQ(3u, rows.size());
+    EXPECT_EQ("1399", rows[0][0]);
+    EXPECT_EQ("a\n\"b\"", rows[1][1]);
+    EXPECT_EQ("1401", rows[2][0]);
+    rows = sfcsv::read_rows(in, idx, 2999, 10);
+    ASSERT_EQ(2u, rows.size());
+    EXPECT_EQ("last", rows[1][1]);
+    EXPECT_TRUE(sfcsv::read_rows(in, idx, 3001, 10).empty());
+
+    sfcsv::source_signature sig;
+    sig.size = csv.size();
+    std::stringstream sidecar;
+    sfcsv::save_row_index(sidecar, idx, sig);
+    sfcsv::row_index loaded;
+    ASSERT_TRUE(sfcsv::load_row_index(sidecar, sig, loaded));
+    EXPECT_EQ(idx.offsets, loaded.offsets);
+    EXPECT_EQ(idx.rows, loaded.rows);
+
+    // A zero stride, offsets that don't cover the rows or a corrupt count are rejected
+    const auto corrupt = [&](const std::size_t at, const std::uint64_t value) {
+        std::string b = sidecar.str();
+        std::memcpy(&b[at], &value, sizeof(value));
+        std::istringstream bad(b);
+        return sfcsv::load_row_index(bad, sig, loaded);
+    };
+    EXPECT_FALSE(corrupt(36, 0));
+    EXPECT_FALSE(corrupt(44, 3101));
+    EXPECT_FALSE(corrupt(52, std::uint64_t(1) << 60));
+    EXPECT_TRUE(corrupt(44, 3100));
+
+    // Bare quotes are literal in loose mode and must not shift the offsets
+    std::string loose_csv = "id,size\n";
+    for(int i = 0; i < 300; ++i) {
+        loose_csv += std::to_string(i) + (i % 3 == 0 ? ",5\" pipe\n" : ",\"a\nb\"\n");
+    }
+    std::istringstream loose(loose_csv);
+    const auto loose_idx = sfcsv::build_row_index(loose, 10, ',', sfcsv::mode::loose);
+    EXPECT_EQ(300u, loose_idx.rows);
+    rows = sfcsv::read_rows(loose, loose_idx, 151, 3, ',', sfcsv::mode::loose);
+    ASSERT_EQ(3u, rows.size());
+    EXPECT_EQ("151", rows[0][0]);
+    EXPECT_EQ("5\" pipe", rows[2][1]);
+}
+
+TEST_F(ParserTest, Cancellation)
+{
+    std::string csv = "id,v\n";
+    for(int i = 0; i < 200000; ++i) {
+        csv += std::to_string(i) + ",x\n";
+    }
+
+    sfcsv::cancellation expired(std::chrono::milliseconds(-1));
+    EXPECT_TRUE(expired.cancelled());
+    std::istringstream in(csv);
+    EXPECT_THROW(sfcsv::build_row_index(in, 1024, ',', sfcsv::mode::strict, &expired), sfcsv::cancelled_error);
+
+    // Readers stop within a block of input after cancel()
+    sfcsv::cancellation token;
+    in.clear();
+    in.seekg(0);
+    sfcsv::reader r(in);
+    r.set_cancellation(&token);
+    std::string record;
+    std::size_t records = 0;
+    try {
+        while(r.read_record(record)) {
+            if(++records == 1000) {
+                token.cancel();
+            }
+        }
+        FAIL();
+    }
+    catch(const sfcsv::cancelled_error &) {
+        EXPECT_LT(records, 1000u + 65536 / 6);
+    }
+
+    // All threads stop soon after one of them cancels
+    sfcsv::cancellation shared;
+    sfcsv::scan_counters counters(2, 4);
+    EXPECT_THROW(sfcsv::parallel_for_each_row(csv.data(), csv.data() + csv.size(),
+                                              [&](unsigned, const auto &) {
+        shared.cancel();
+    }, counters, ',', sfcsv::mode::strict, &shared), sfcsv::cancelled_error);
+    EXPECT_LT(counters.snapshot().rows, 4u * 65536 / 8);
+
+    sfcsv::cancellation unused(std::chrono::hours(1));
+    EXPECT_EQ(200000u, sfcsv::sample_records(csv.data(), csv.data() + csv.size(), 300000, 0, ',',
+                                             sfcsv::mode::strict, 2, &unused).size());
+}
+
+struct Trade {
+    long long id;
+    double px;
+    unsigned qty;
+    std::string sym;
+};
+
+TEST_F(ParserTest, StructFields)
+{
+    const auto trade_fields = sfcsv::fields(&Trade::id, &Trade::px, &Trade::qty, &Trade::sym);
+
+    Trade t {};
+    sfcsv::parse_struct(std::string(R"(42,101.25,300,"AB,C")"), t, trade_fields);
+    EXPECT_EQ(42, t.id);
+    EXPECT_DOUBLE_EQ(101.25, t.px);
+    EXPECT_EQ(300u, t.qty);
+    EXPECT_EQ("AB,C", t.sym);
+
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1,2.0,3"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1,2.0,3,x,y"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1,abc,3,x"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1,2.0,-3,x"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1,2.0, -3,x"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1,2.0, 5,x"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string(" 5,2.0,3,x"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1, 2.0,3,x"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("+,2.0,3,x"), t, trade_fields));
+    EXPECT_ANY_THROW(sfcsv::parse_struct(std::string("1,2.0,+,x"), t, trade_fields));
+
+    std::string out;
+    sfcsv::encode_struct(Trade {7, 0.5, 10, "say \"hi\""}, trade_fields,
+                         std::back_inserter(all), ";");
+    for(const auto& f : all) {
+        out += f;
+    }
+    EXPECT_EQ(R"("7";"0.5";"10";"say ""hi""")", out);
+}
+
+TEST_F(ParserTest, ErrorPosition)
+{
+    try {
+        parse(R"(one,"two" ,three)");
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_EQ(sfcsv::npos, e.record());
+        EXPECT_EQ(1u, e.field());
+        EXPECT_EQ(9u, e.offset());
+        EXPECT_EQ(R"(one,"two" ,three)", e.excerpt());
+    }
+
+    std::istringstream in("a,b\n1,2\n3,x\"y\n");
+    sfcsv::reader r(in);
+    EXPECT_TRUE(r.read_row(std::back_inserter(result)));
+    EXPECT_TRUE(r.read_row(std::back_inserter(result)));
+    try {
+        r.read_row(std::back_inserter(result));
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_EQ(2u, e.record());
+        EXPECT_EQ(1u, e.field());
+        EXPECT_EQ(11u, e.offset());
+    }
+
+    try {
+        sfcsv::parse_line<2>(std::string(R"(a,"b,c",d)"));
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_EQ(2u, e.field());
+        EXPECT_EQ(8u, e.offset());
+    }
+
+    try {
+        sfcsv::parse_line<3>(std::string("a,b"));
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_EQ(1u, e.field());
+        EXPECT_EQ(3u, e.offset());
+    }
+
+    const auto trade_fields = sfcsv::fields(&Trade::id, &Trade::px, &Trade::qty, &Trade::sym);
+    Trade t {};
+    try {
+        sfcsv::parse_struct(std::string("1,abc,3,x"), t, trade_fields);
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_STREQ("Invalid floating point field", e.what());
+        EXPECT_EQ(1u, e.field());
+        EXPECT_EQ(2u, e.offset());
+    }
+
+    std::istringstream keyed("k,v\n1,a\n22\n");
+    try {
+        sfcsv::build_key_index(keyed, 1);
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_EQ(2u, e.record());
+        EXPECT_EQ(8u, e.offset());
+    }
+
+    std::istringstream quoted_key("k,v\n\"33\"\n");
+    try {
+        sfcsv::build_key_index(quoted_key, 1);
+        FAIL();
+    }
+    catch(const sfcsv::csv_error &e) {
+        EXPECT_EQ(1u, e.record());
+        EXPECT_EQ(4u, e.offset());
+        EXPECT_EQ("\"33\"", e.excerpt());
+    }
+}
+
 struct QtStringPolicy {
     template <class StringT, class CharT = typename StringT::value_type>
     static void append(StringT &str, const CharT c) {
@@ -325,8 +1390,53 @@ struct QtStringPolicy {
     static bool empty(const StringT &str) {
         return str.isEmpty();
     }
+
+    template <class StringT>
+    static void reserve(StringT &str, const std::size_t count) {
+        str.reserve(str.size() + static_cast<int>(count));
+    }
+
+    template <class StringT, class InIter>
+    static void assign(StringT &str, InIter first, InIter last) {
+        str.setUnicode(&*first, static_cast<int>(std::distance(first, last)));
+    }
+};
+
+// String type with only what default_policy requires
+class minimal_string {
+    std::string _s;
+
+public:
+    using value_type = char;
+    using const_iterator = std::string::const_iterator;
+
+    minimal_string() = default;
+    minimal_string(const char *s) : _s(s) {}
+
+    const_iterator cbegin() const { return _s.cbegin(); }
+    const_iterator cend() const { return _s.cend(); }
+    bool empty() const { return _s.empty(); }
+    minimal_string &operator+=(const char c) { _s += c; return *this; }
+    void append(const unsigned count, const char c) { _s.append(count, c); }
+    const std::string &str() const { return _s; }
 };
 
+TEST_F(ParserTest, MinimalString)
+{
+    static_assert(!sfcsv::detail::has_reserve<sfcsv::default_policy, minimal_string>::value, "");
+    static_assert(!sfcsv::detail::has_assign<sfcsv::default_policy, minimal_string,
+                                             minimal_string::const_iterator>::value, "");
+    static_assert(!sfcsv::detail::has_clear_keep_capacity<sfcsv::default_policy,
+                                                          minimal_string>::value, "");
+
+    std::vector<minimal_string> parsed;
+    sfcsv::parse_line(minimal_string(R"(one,"t,""w""o",)"), std::back_inserter(parsed));
+    ASSERT_EQ(3u, parsed.size());
+    EXPECT_EQ("one", parsed[0].str());
+    EXPECT_EQ(R"(t,"w"o)", parsed[1].str());
+    EXPECT_EQ("", parsed[2].str());
+}
+
 TEST_F(ParserTest, QStringTest)
 {
     QList<QString> parsed;
@@ -335,6 +1445,73 @@ TEST_F(ParserTest, QStringTest)
     EXPECT_TRUE(parsed.size() == 2);
     EXPECT_TRUE(parsed.at(0) == "hello");
     EXPECT_TRUE(parsed.at(1) == "world");
+
+    parsed.clear();
+    str = R"("say ""hi""",x)";
+    sfcsv::parse_line<QtStringPolicy>(str, std::back_inserter(parsed), ',');
+    EXPECT_TRUE(parsed.size() == 2);
+    EXPECT_TRUE(parsed.at(0) == R"(say "hi")");
+    EXPECT_TRUE(parsed.at(1) == "x");
+}
+
+TEST_F(ParserTest, Utf16Strings)
+{
+    QList<QString> parsed;
+    QString str = R"(a long unquoted field,"a long quoted field, with ""quotes""",x)";
+    sfcsv::parse_line<QtStringPolicy>(str, std::back_inserter(parsed), ',');
+    EXPECT_TRUE(parsed.size() == 3);
+    EXPECT_TRUE(parsed.at(0) == "a long unquoted field");
+    EXPECT_TRUE(parsed.at(1) == R"(a long quoted field, with "quotes")");
+    EXPECT_TRUE(parsed.at(2) == "x");
+
+    std::vector<sfcsv::lazy_field<QString::const_iterator>> fields;
+    sfcsv::split_line(str, std::back_inserter(fields), QChar(','));
+    EXPECT_TRUE(fields.size() == 3);
+    EXPECT_TRUE(QString(fields[0].begin(), fields[0].end() - fields[0].begin()) == "a long unquoted field");
+    EXPECT_TRUE(fields[1].escaped());
+
+    std::vector<std::u16string> wide;
+    sfcsv::parse_line(std::u16string(u"\u4e2d\u6587 text in a long field;\"quoted;field\""),
+                      std::back_inserter(wide), u';');
+    EXPECT_EQ(std::vector<std::u16string>({u"\u4e2d\u6587 text in a long field", u"quoted;field"}), wide);
+    EXPECT_ANY_THROW(sfcsv::parse_line(std::u16string(u"a long field before\nnewline"),
+                                       std::back_inserter(wide), u','));
+}
+
+TEST_F(ParserTest, WideStrings)
+{
+    std::vector<std::wstring> wide;
+    sfcsv::parse_line(std::wstring(LR"(plain,"quoted, ""wide"" field")"), std::back_inserter(wide));
+    EXPECT_EQ(std::vector<std::wstring>({L"plain", LR"(quoted, "wide" field)"}), wide);
+
+    std::wostringstream wos;
+    sfcsv::encode_line(wide.cbegin(), wide.cend(), std::ostream_iterator<std::wstring, wchar_t>(wos));
+    EXPECT_EQ(LR"("plain","quoted, ""wide"" field")", wos.str());
+
+    std::vector<std::u32string> utf32;
+    sfcsv::parse_line(std::u32string(U"\U0001F600 in a long enough field;\"x;y\""),
+                      std::back_inserter(utf32), U';');
+    EXPECT_EQ(std::vector<std::u32string>({U"\U0001F600 in a long enough field", U"x;y"}), utf32);
+    EXPECT_EQ(U"\"a\"\"b\"", sfcsv::encode_field(std::u32string(U"a\"b")));
+
+    std::wistringstream win(L"a,b\n1,\"2\n3\"\n");
+    sfcsv::basic_reader<wchar_t> wr(win);
+    wide.clear();
+    EXPECT_TRUE(wr.read_row(std::back_inserter(wide)));
+    wide.clear();
+    EXPECT_TRUE(wr.read_row(std::back_inserter(wide)));
+    EXPECT_EQ(std::vector<std::wstring>({L"1", L"2\n3"}), wide);
+    EXPECT_FALSE(wr.read_row(std::back_inserter(wide)));
+
+    std::basic_istringstream<char16_t> in16(u"a,b\n\"1\n2\",3");
+    sfcsv::basic_reader<char16_t> r16(in16);
+    std::vector<std::u16string> utf16;
+    EXPECT_TRUE(r16.read_row(std::back_inserter(utf16)));
+    utf16.clear();
+    EXPECT_TRUE(r16.read_row(std::back_inserter(utf16)));
+    EXPECT_EQ(std::vector<std::u16string>({u"1\n2", u"3"}), utf16);
+    EXPECT_EQ(4u, r16.record_offset());
+    EXPECT_FALSE(r16.read_row(std::back_inserter(utf16)));
 }
 
 int main(int argc, char **argv)
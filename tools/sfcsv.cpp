@@ -0,0 +1,170 @@
+/****************************************************************************
+
+The MIT License (MIT)
+
+Copyright (c) 2014 https://github.com/labyrinthofdreams
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+
+// Command line tools for CSV files.
+//
+// Usage:
+//   sfcsv head [-n records] [-d separator] [-t seconds] <file.csv | ->
+//   sfcsv tail [-n records] [-d separator] [-t seconds] <file.csv>
+//
+// head prints the header and the first records (10 by default) as they
+// are in the file. It stops reading right after the last one, and a
+// record longer than 1 MiB is reported as an error instead of making
+// it read the rest of the file.
+//
+// tail prints the header and the last records. It reads the file from
+// the end, so it needs a seekable file rather than a pipe.
+//
+// With -t, a command that runs longer than the given number of seconds
+// stops and exits with status 124, like timeout(1).
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../sfcsv.h"
+
+namespace {
+
+const std::size_t max_record_size = 1 << 20;
+
+struct options {
+    std::size_t records = 10;
+    char sep = ',';
+    double timeout = 0;
+    std::string path;
+};
+
+// Parse the options after the command, returns false on invalid ones
+bool parse_options(const std::vector<std::string> &args, options &opts) {
+    for(std::size_t i = 1; i < args.size(); ++i) {
+        if(args[i] == "-n" && i + 1 < args.size()) {
+            opts.records = std::stoul(args[++i]);
+        }
+        else if(args[i] == "-d" && i + 1 < args.size() && args[i + 1].size() == 1) {
+            opts.sep = args[++i][0];
+        }
+        else if(args[i] == "-t" && i + 1 < args.size()) {
+            opts.timeout = std::stod(args[++i]);
+        }
+        else if(opts.path.empty()) {
+            opts.path = args[i];
+        }
+        else {
+            return false;
+        }
+    }
+
+    return !opts.path.empty();
+}
+
+int head(std::istream &in, const options &opts, const sfcsv::cancellation *cancel) {
+    sfcsv::reader r(in, opts.sep);
+    r.set_max_record_size(max_record_size);
+    r.set_cancellation(cancel);
+    std::string record;
+    for(std::size_t i = 0; i <= opts.records && r.read_record(record); ++i) {
+        std::cout << record << '\n';
+    }
+
+    return 0;
+}
+
+int tail(std::istream &in, const options &opts, const sfcsv::cancellation *cancel) {
+    sfcsv::reader r(in, opts.sep);
+    r.set_max_record_size(max_record_size);
+    r.set_cancellation(cancel);
+    std::string header;
+    if(!r.read_record(header)) {
+        return 0;
+    }
+
+    in.clear();
+    in.seekg(0);
+    std::cout << header << '\n';
+    for(const auto &record : sfcsv::tail_records(in, opts.records, opts.sep, sfcsv::mode::strict,
+                                                 1 << 16, cancel)) {
+        std::cout << record << '\n';
+    }
+
+    return 0;
+}
+
+int usage() {
+    std::cerr << "Usage:\n"
+              << "  sfcsv head [-n records] [-d separator] [-t seconds] <file.csv | ->\n"
+              << "  sfcsv tail [-n records] [-d separator] [-t seconds] <file.csv>\n";
+    return 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const std::vector<std::string> args(argv + 1, argv + argc);
+    options opts;
+    try {
+        if(args.empty() || !parse_options(args, opts)) {
+            return usage();
+        }
+
+        std::ifstream file;
+        if(opts.path != "-") {
+            file.open(opts.path, std::ios::binary);
+            if(!file) {
+                std::cerr << "Cannot open " << opts.path << std::endl;
+                return 1;
+            }
+        }
+        std::istream &in = opts.path == "-" ? std::cin : file;
+
+        const sfcsv::cancellation deadline(std::chrono::duration<double>(opts.timeout));
+        const auto cancel = opts.timeout > 0 ? &deadline : nullptr;
+        if(args[0] == "head") {
+            return head(in, opts, cancel);
+        }
+        if(args[0] == "tail" && opts.path != "-") {
+            return tail(in, opts, cancel);
+        }
+    }
+    catch(const sfcsv::cancelled_error &) {
+        std::cerr << opts.path << ": Timed out" << std::endl;
+        return 124;
+    }
+    catch(const sfcsv::csv_error &e) {
+        std::cerr << opts.path << ": " << e.what() << " (record " << e.record()
+                  << ", offset " << e.offset() << ")" << std::endl;
+        return 1;
+    }
+    catch(const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return usage();
+}
@@ -0,0 +1,112 @@
+/****************************************************************************
+
+The MIT License (MIT)
+
+Copyright (c) 2014 https://github.com/labyrinthofdreams
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+
+// Lookup daemon that keeps a CSV source and its key index resident
+// and answers requests over a Unix domain socket.
+//
+// Usage:
+//   sfcsvd serve <socket> <file.csv> <key column> [cache size] [scan timeout seconds]
+//   sfcsvd get <socket> <key>
+//   sfcsvd scan <socket> <column> <value>
+//
+// The protocol is described in sfcsvd.h.
+
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "sfcsvd.h"
+
+namespace {
+
+int serve(const std::string &socket_path, const std::string &path,
+          const std::size_t column, const std::size_t cache_size, const double scan_timeout) {
+    sfcsvd::server_state state(path, column, cache_size, scan_timeout);
+
+    // Clients that hang up must not kill the daemon
+    std::signal(SIGPIPE, SIG_IGN);
+
+    const int server = sfcsvd::listen_at(socket_path);
+    if(server < 0) {
+        std::cerr << "Cannot listen on " << socket_path << std::endl;
+        return 1;
+    }
+
+    sfcsvd::run(server, state);
+    ::close(server);
+    return 1;
+}
+
+int query(const std::string &socket_path, const sfcsvd::op request, const std::uint32_t column,
+          const std::string &value) {
+    std::vector<std::string> lines;
+    const bool ok = sfcsvd::request(socket_path, request, column, value, lines);
+    for(const auto &line : lines) {
+        std::cout << line << '\n';
+    }
+    if(!ok) {
+        std::cerr << "Request failed" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+int usage() {
+    std::cerr << "Usage:\n"
+              << "  sfcsvd serve <socket> <file.csv> <key column> [cache size] [scan timeout seconds]\n"
+              << "  sfcsvd get <socket> <key>\n"
+              << "  sfcsvd scan <socket> <column> <value>\n";
+    return 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const std::vector<std::string> args(argv + 1, argv + argc);
+    try {
+        if(args.size() >= 4 && args[0] == "serve") {
+            const std::size_t cache_size = args.size() > 4 ? std::stoul(args[4]) : 1024;
+            const double scan_timeout = args.size() > 5 ? std::stod(args[5]) : 0;
+            return serve(args[1], args[2], std::stoul(args[3]), cache_size, scan_timeout);
+        }
+        if(args.size() == 3 && args[0] == "get") {
+            return query(args[1], sfcsvd::op_get, 0, args[2]);
+        }
+        if(args.size() == 4 && args[0] == "scan") {
+            return query(args[1], sfcsvd::op_scan, static_cast<std::uint32_t>(std::stoul(args[2])),
+                         args[3]);
+        }
+    }
+    catch(const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return usage();
+}
@@ -0,0 +1,385 @@
+/****************************************************************************
+
+The MIT License (MIT)
+
+Copyright (c) 2014 https://github.com/labyrinthofdreams
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+
+// Protocol, server and client of sfcsvd, shared by the tool and the tests.
+//
+// Protocol (native byte order, one request per connection):
+//   Request:  u8 op (1 = get, 2 = scan), u32 column, u32 length, value bytes
+//   Response: u32 status (0 = ok, 1 = error), u32 count,
+//             count times: u32 length, CSV line bytes
+//
+// Values longer than max_value_size are rejected. Each client is served on
+// its own thread and dropped if it stalls for client_timeout seconds.
+
+#ifndef SFCSVD_H
+#define SFCSVD_H
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../sfcsv.h"
+
+namespace sfcsvd {
+
+enum op : std::uint8_t {
+    op_get = 1,
+    op_scan = 2
+};
+
+// Longest value a request may carry
+const std::uint32_t max_value_size = 1 << 16;
+
+// Seconds a client may stall while sending or receiving
+const int client_timeout = 5;
+
+// Clients served at once, more are turned away
+const std::size_t max_clients = 64;
+
+#ifdef MSG_NOSIGNAL
+const int send_flags = MSG_NOSIGNAL;
+#else
+const int send_flags = 0;
+#endif
+
+inline bool read_all(const int fd, void *data, std::size_t size) {
+    auto p = static_cast<char *>(data);
+    while(size > 0) {
+        const auto n = ::read(fd, p, size);
+        if(n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<std::size_t>(n);
+    }
+
+    return true;
+}
+
+inline bool write_all(const int fd, const void *data, std::size_t size) {
+    auto p = static_cast<const char *>(data);
+    while(size > 0) {
+        const auto n = ::send(fd, p, size, send_flags);
+        if(n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<std::size_t>(n);
+    }
+
+    return true;
+}
+
+template <class T>
+bool write_pod(const int fd, const T value) {
+    return write_all(fd, &value, sizeof(value));
+}
+
+template <class T>
+bool read_pod(const int fd, T &value) {
+    return read_all(fd, &value, sizeof(value));
+}
+
+inline sockaddr_un make_address(const std::string &path) {
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path is too long");
+    }
+    path.copy(addr.sun_path, path.size());
+    return addr;
+}
+
+inline bool write_rows(const int fd, const std::uint32_t status,
+                       const std::vector<std::vector<std::string>> &rows) {
+    if(!write_pod(fd, status) || !write_pod(fd, static_cast<std::uint32_t>(rows.size()))) {
+        return false;
+    }
+
+    for(const auto &row : rows) {
+        std::ostringstream line;
+        sfcsv::encode_line(row.cbegin(), row.cend(), std::ostream_iterator<std::string>(line));
+        const auto s = line.str();
+        if(!write_pod(fd, static_cast<std::uint32_t>(s.size())) || !write_all(fd, s.data(), s.size())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Scan all records for a value in a column, decoding only that column
+inline std::vector<std::vector<std::string>> scan(std::istream &in, const std::size_t column,
+                                                  const std::string &value, const double timeout) {
+    in.clear();
+    in.seekg(0);
+    const sfcsv::cancellation deadline{std::chrono::duration<double>(timeout)};
+    sfcsv::reader r(in);
+    r.set_cancellation(timeout > 0 ? &deadline : nullptr);
+    std::string header;
+    r.read_record(header);
+
+    std::vector<std::vector<std::string>> rows;
+    std::vector<sfcsv::lazy_field<std::string::const_iterator>> fields;
+    while(r.read_fields(std::back_inserter(fields))) {
+        if(column < fields.size() && fields[column].str() == value) {
+            rows.emplace_back();
+            for(const auto &f : fields) {
+                rows.back().push_back(f.str());
+            }
+        }
+        fields.clear();
+    }
+
+    return rows;
+}
+
+inline sfcsv::key_index load_index(std::istream &csv, const std::string &path,
+                                   const std::size_t column) {
+    if(!csv) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    struct stat st {};
+    if(::stat(path.c_str(), &st) != 0) {
+        throw std::runtime_error("Cannot stat " + path);
+    }
+    const auto sig = sfcsv::make_signature(csv, static_cast<std::uint64_t>(st.st_mtime));
+    const auto index_path = path + ".sfck";
+
+    sfcsv::key_index idx;
+    std::ifstream cached(index_path, std::ios::binary);
+    if(cached && sfcsv::load_key_index(cached, sig, idx) && idx.column == column) {
+        return idx;
+    }
+
+    idx = sfcsv::build_key_index(csv, column);
+
+    // Written aside and renamed so a failed write never leaves a bad index
+    const auto tmp_path = index_path + ".tmp" + std::to_string(std::random_device()());
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if(!out) {
+        return idx;
+    }
+    sfcsv::save_key_index(out, idx, sig);
+    out.close();
+    if(!out || std::rename(tmp_path.c_str(), index_path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+    }
+    return idx;
+}
+
+// Source, key index and client count shared by the client threads
+struct server_state {
+    server_state(const std::string &source, const std::size_t column,
+                 const std::size_t cache_size, const double timeout)
+        : path(source), scan_timeout(timeout), csv(source, std::ios::binary),
+          table(csv, load_index(csv, source, column), cache_size) {}
+
+    const std::string path;
+    const double scan_timeout;
+
+    std::ifstream csv;
+    std::mutex table_mutex;
+    sfcsv::lookup_table table;
+
+    std::mutex clients_mutex;
+    std::condition_variable clients_done;
+    std::size_t clients = 0;
+};
+
+inline std::vector<std::vector<std::string>> answer(server_state &state, const std::uint8_t op,
+                                                    const std::uint32_t column,
+                                                    const std::string &value) {
+    if(op == op_get) {
+        std::lock_guard<std::mutex> lock(state.table_mutex);
+        return state.table.find(value);
+    }
+    if(op == op_scan) {
+        // Each scan reads its own stream so scans don't wait for each other
+        std::ifstream csv(state.path, std::ios::binary);
+        if(!csv) {
+            throw std::runtime_error("Cannot open " + state.path);
+        }
+        return scan(csv, column, value, state.scan_timeout);
+    }
+
+    throw std::runtime_error("Unknown request");
+}
+
+// Answer one request, never throws
+inline void handle(const int fd, server_state &state) {
+    const timeval timeout {client_timeout, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::uint8_t op = 0;
+    std::uint32_t column = 0;
+    std::uint32_t length = 0;
+    if(!read_pod(fd, op) || !read_pod(fd, column) || !read_pod(fd, length)) {
+        return;
+    }
+
+    if(length > max_value_size) {
+        write_rows(fd, 1, {});
+        return;
+    }
+
+    std::string value(length, '\0');
+    if(!read_all(fd, &value[0], length)) {
+        return;
+    }
+
+    std::uint32_t status = 0;
+    std::vector<std::vector<std::string>> rows;
+    try {
+        rows = answer(state, op, column, value);
+    }
+    catch(const std::exception &) {
+        status = 1;
+        rows.clear();
+    }
+
+    try {
+        write_rows(fd, status, rows);
+    }
+    catch(const std::exception &) {
+    }
+}
+
+// Listening socket at socket_path, or -1
+inline int listen_at(const std::string &socket_path) {
+    const auto addr = make_address(socket_path);
+    const int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0) {
+        return -1;
+    }
+
+    ::unlink(socket_path.c_str());
+    if(::bind(server, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0
+            || ::listen(server, 16) != 0) {
+        ::close(server);
+        return -1;
+    }
+
+    return server;
+}
+
+// Serve clients on their own threads until the server socket is shut down,
+// then wait for the clients being served
+inline void run(const int server, server_state &state) {
+    for(;;) {
+        const int client = ::accept(server, nullptr, nullptr);
+        if(client < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(state.clients_mutex);
+            if(state.clients == max_clients) {
+                ::close(client);
+                continue;
+            }
+            ++state.clients;
+        }
+
+        const auto done = [client, &state] {
+            ::close(client);
+            std::lock_guard<std::mutex> lock(state.clients_mutex);
+            --state.clients;
+            state.clients_done.notify_all();
+        };
+        try {
+            std::thread([client, &state, done] {
+                handle(client, state);
+                done();
+            }).detach();
+        }
+        catch(const std::system_error &) {
+            done();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(state.clients_mutex);
+    state.clients_done.wait(lock, [&state] {
+        return state.clients == 0;
+    });
+}
+
+// Send a request and collect the CSV lines of the response, false on failure
+inline bool request(const std::string &socket_path, const op request, const std::uint32_t column,
+                    const std::string &value, std::vector<std::string> &lines) {
+    const auto addr = make_address(socket_path);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+        if(fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+
+    std::uint32_t status = 1;
+    std::uint32_t count = 0;
+    bool ok = write_pod(fd, static_cast<std::uint8_t>(request)) && write_pod(fd, column)
+              && write_pod(fd, static_cast<std::uint32_t>(value.size()))
+              && write_all(fd, value.data(), value.size())
+              && read_pod(fd, status) && read_pod(fd, count) && status == 0;
+    for(std::uint32_t i = 0; ok && i < count; ++i) {
+        std::uint32_t length = 0;
+        ok = read_pod(fd, length);
+        if(ok) {
+            std::string line(length, '\0');
+            ok = read_all(fd, &line[0], length);
+            lines.push_back(std::move(line));
+        }
+    }
+
+    ::close(fd);
+    return ok;
+}
+
+} // namespace sfcsvd
+
+#endif // SFCSVD_H